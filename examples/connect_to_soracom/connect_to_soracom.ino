@@ -29,15 +29,12 @@ void onAsyncResponse(const String& response) {
 }
 
 String waitAsyncEvent(const String& asyncEvent, int timeoutMs) {
+  // Other URCs stay queued for their owners while waiting.
   String asyncResponse;
-  while (modem->getAsyncEvent(asyncResponse, timeoutMs)) {
+  if (modem->waitForUrc(asyncEvent, asyncResponse, timeoutMs)) {
     asyncResponse.trim();
-    if (asyncResponse.indexOf(asyncEvent) != -1) {
-      Serial.println("[Match Found]: " + asyncResponse);
-      return asyncResponse;
-    } else {
-      Serial.println("[Skip Unrelated Response]: " + asyncResponse);
-    }
+    Serial.println("[Match Found]: " + asyncResponse);
+    return asyncResponse;
   }
   return "";
 }
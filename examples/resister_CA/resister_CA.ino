@@ -24,15 +24,14 @@ const int BAUD_RATE = 115200;           // baud rate
  * @brief Registers a CA certificate to the modem.
  *
  * This function sends an AT command to the modem to register a CA certificate
- * with the specified name and PEM data. It sends the PEM data line by line
+ * with the specified name and PEM data. It streams the PEM data in one write
  * and waits for a response to confirm successful registration.
  *
  * @param certName The name of the certificate to be registered.
  * @param pemData The PEM formatted certificate data.
- * @param delayMs The delay in milliseconds between sending each line of PEM data.
  * @return true if the certificate is registered successfully, false otherwise.
  */
-bool registerCaCertificate(const String &certName, const String &pemData, unsigned int delayMs = 0) {
+bool registerCaCertificate(const String &certName, const String &pemData) {
   const char prompt = '>';
   String command = "AT+USECMNG=0,0,\"" + certName + "\"," + String(pemData.length());
   std::vector<String> responses;
@@ -48,22 +47,11 @@ bool registerCaCertificate(const String &certName, const String &pemData, unsign
   }
   modem->setDisablePrompt();
 
-  Serial.println("Sending PEM data line by line...");
-
-  int startIdx = 0;
-  while (startIdx < pemData.length()) {
-    int endIdx = pemData.indexOf('\n', startIdx);
-    if (endIdx == -1) {
-      endIdx = pemData.length();
-    }
-    String line = pemData.substring(startIdx, endIdx + 1);
-    modem->sendStringData(line);
-    Serial.print("Sent: ");
-    Serial.print(line);
-
-    delay(delayMs);
-
-    startIdx = endIdx + 1;
+  Serial.println("Sending PEM data...");
+  size_t written = modem->write((const uint8_t*)pemData.c_str(), pemData.length());
+  if (written != pemData.length()) {
+    Serial.println("Error: Only " + String(written) + " bytes of PEM data were sent.");
+    return false;
   }
 
   Serial.println("PEM data sent. Awaiting response...");
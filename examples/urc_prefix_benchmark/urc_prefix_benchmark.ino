@@ -0,0 +1,85 @@
+/**
+ * @file urc_prefix_benchmark.ino
+ * @brief Microbenchmark of the URC prefix matcher for CM01-SARA-R.
+ *
+ * Compares ModemHandler::isAsyncResponse, which uses the prefix trie compiled
+ * by setAsyncResponsePrefixes, against the linear startsWith scan the library
+ * used before. No modem is required; begin() is never called.
+ *
+ * @date 2026-10-16
+ *
+ * licesence: MIT
+ */
+
+#include <Arduino.h>
+#include <CM01-SARA-R.h>
+
+const int ITERATIONS = 2000;
+
+const std::vector<String> PREFIXES = {
+  "+UFOTASTAT:", "+ULWM2MSTAT:", "+UUPSDA:", "+UUPSDD:", "+UUSIMSTAT:",
+  "+UUHTTPCR:", "+UUSORD:", "+UUSORF:", "+UUSOCL:", "+UUSOLI:",
+  "+UUSOCO:", "+UUMQTTC:", "+UUMQTTCM:", "+UUMQTTSB:", "+UUMQTTUS:",
+  "+CEREG:", "+CREG:", "+CGREG:", "+UUPSMR:", "+CEDRXP:",
+  "+UUFTPCR:", "+UUFTPCD:", "+UULOC:", "+CIEV:", "+UUCMEE:"
+};
+
+const std::vector<String> LINES = {
+  "OK",
+  "+CSQ: 17,99",
+  "+UUSORD: 0,128",
+  "+UUPSDA: 0,\"10.0.0.1\"",
+  "+UUMQTTCM: 6,1",
+  "+CME ERROR: operation not allowed",
+  "+UUPSMR: 1",
+  "+URDFILE: \"get.ffs\",32,\"0123456789abcdef0123456789abcdef\""
+};
+
+ModemHandler* modem;
+
+bool linearScan(const String& line) {
+  for (const auto& prefix : PREFIXES) {
+    if (line.startsWith(prefix)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * @brief Runs both matchers over the sample lines and prints their timings.
+ */
+void setup() {
+  Serial.begin(115200);
+  delay(1000);
+
+  modem = new ModemHandler(Serial2);
+  modem->setAsyncResponsePrefixes(PREFIXES);
+
+  int linearMatches = 0;
+  unsigned long start = micros();
+  for (int i = 0; i < ITERATIONS; i++) {
+    for (const auto& line : LINES) {
+      if (linearScan(line)) linearMatches++;
+    }
+  }
+  unsigned long linearTime = micros() - start;
+
+  int trieMatches = 0;
+  start = micros();
+  for (int i = 0; i < ITERATIONS; i++) {
+    for (const auto& line : LINES) {
+      if (modem->isAsyncResponse(line)) trieMatches++;
+    }
+  }
+  unsigned long trieTime = micros() - start;
+
+  unsigned long lineCount = (unsigned long)ITERATIONS * LINES.size();
+  Serial.println("Prefixes: " + String(PREFIXES.size()) + ", lines classified: " + String(lineCount));
+  Serial.println("Linear scan: " + String(linearTime) + " us (" + String(linearMatches) + " matches)");
+  Serial.println("Prefix trie: " + String(trieTime) + " us (" + String(trieMatches) + " matches)");
+}
+
+void loop() {
+  delay(1000);
+}
@@ -1,26 +1,234 @@
 #include <CM01-SARA-R.h>
+#include <ModemIdentityStore.h>
 
-ModemHandler::ModemHandler(HardwareSerial& serialPort, int responseQueueSize, int asyncQueueSize)
-    : serial(&serialPort), buffer(""), asyncCallback(nullptr), debugMode(false) {
-    responseQueue = xQueueCreate(responseQueueSize, sizeof(String*));
-    asyncEventQueue = xQueueCreate(asyncQueueSize, sizeof(String*));
+// min() takes its arguments by reference, which needs these defined before C++17.
+constexpr size_t ModemHandler::SMALL_SLAB_SIZE;
+constexpr size_t ModemHandler::TRACE_MAX_DATA_LENGTH;
+constexpr size_t ModemHandler::UART_WRITE_CHUNK_SIZE;
+constexpr int ModemHandler::READY_PROBE_MAX_INTERVAL_MS;
+
+ModemHandler::ModemHandler(HardwareSerial& serialPort, int responseQueueSize, int asyncQueueSize,
+                           size_t lineBufferSize)
+    : serial(&serialPort), lineBufferSize(lineBufferSize), lineLength(0), lineOverflowed(false),
+      overlongLinePolicy(OverlongLinePolicy::Split), overlongLineCount(0),
+      lineQuoteCount(0), payloadRemaining(0), linePayloadOffset(0), linePayloadLength(0),
+      linePoolExhaustedCount(0), receiveMode(ReceiveMode::Polling), uartNum(UART_NUM_2),
+      uartEventQueue(nullptr), baudRate(DEFAULT_BAUD_RATE), enablePrompt(false), promptCharacter('>'), debugMode(false),
+      traceRing(nullptr), traceDropCount(0), finalResultCodes(0), asyncCallback(nullptr) {
+    initLineQueue(responseQueue, responseQueueSize);
+    initLineQueue(asyncEventQueue, asyncQueueSize);
+    commandMutex = xSemaphoreCreateRecursiveMutex();
+    commandQueue = xQueueCreate(COMMAND_QUEUE_SIZE, sizeof(std::shared_ptr<PendingCommand>*));
+    executorMutex = xSemaphoreCreateMutex();
+    executorStarted = false;
+    commandSequence = 0;
+    rxSequence = 0;
+    owedResultCodes = 0;
+    awaitingResult = false;
+    staleLock = portMUX_INITIALIZER_UNLOCKED;
+    abandonedSettled = xSemaphoreCreateBinary();
+    lateLineCount = 0;
+    lineBuffer = new char[lineBufferSize + 1];
+    payloadResponsePrefixes = {"+URDFILE:", "+URDBLOCK:", "+USORD:", "+USORF:"};
+
+    // Every queued line lives in a slab of this pool; slabs travel through the
+    // queues by index and go back to their free queue once the consumer copied
+    // them. Most lines are short, so only a few slabs can hold a full line.
+    int slabCount = responseQueueSize + asyncQueueSize + LINE_POOL_SPARE;
+    size_t smallSlabSize = min(SMALL_SLAB_SIZE, lineBufferSize);
+    lineSlabStorage = new char[slabCount * (smallSlabSize + 1) + LINE_POOL_LARGE_SLABS * (lineBufferSize + 1)];
+    lineSlabs.resize(slabCount + LINE_POOL_LARGE_SLABS);
+    freeSlabQueue = xQueueCreate(slabCount, sizeof(uint16_t));
+    freeLargeSlabQueue = xQueueCreate(LINE_POOL_LARGE_SLABS, sizeof(uint16_t));
+    slabMutex = xSemaphoreCreateMutex();
+    urcMutex = xSemaphoreCreateRecursiveMutex();
+    started = false;
+    readyEvents = xEventGroupCreate();
+    identityStore = nullptr;
+    uartPowerSaving = UartPowerSaving::Disabled;
+    uartIdleTimeoutMs = 0;
+    lastRxActivity = 0;
+    commandLockDepth = 0;
+    rtsReleased = false;
+    powerState = PowerState::Awake;
+    directLinkPending = false;
+    directLinkActive = false;
+    directLinkSkipLf = false;
+    directLinkMatch = 0;
+    lastDirectLinkWrite = 0;
+    directLinkRing = nullptr;
+    directLinkClosed = xSemaphoreCreateBinary();
+    directLinkDropCount = 0;
+    readyTimeoutMs = 0;
+    char* storage = lineSlabStorage;
+    for (uint16_t i = 0; i < lineSlabs.size(); i++) {
+        lineSlabs[i].data = storage;
+        lineSlabs[i].large = i >= slabCount;
+        lineSlabs[i].capacity = lineSlabs[i].large ? lineBufferSize : smallSlabSize;
+        lineSlabs[i].length = 0;
+        lineSlabs[i].owner = nullptr;
+        storage += lineSlabs[i].capacity + 1;
+        releaseSlab(i);
+    }
+    setUrcHandler("+UUPSMR:", [this](const String& params) { onPowerSavingReport(params); });
 }
 
-void ModemHandler::begin() {
+void ModemHandler::initLineQueue(LineQueueState& queue, int size) {
+    queue.handle = xQueueCreate(size, sizeof(uint16_t));
+    queue.policy = OverflowPolicy::DropNewest;
+    queue.blockTimeoutMs = 0;
+    queue.stats = {};
+    queue.stats.capacity = size;
+}
+
+bool ModemHandler::begin(bool waitForReady, int readyTimeoutMs) {
+    // Identity values from the last boot are usable while the modem starts.
+    if (identityStore) identityStore->load();
     powerOnModem();
     initSerial();
     setDisablePrompt();
+    started = true;
     xTaskCreatePinnedToCore(readFromModemTask, "ReadModemTask", 4096, this, 1, NULL, 1);
-    delay(6000);
+
+    if (waitForReady) {
+        return startUp(readyTimeoutMs);
+    }
+    this->readyTimeoutMs = readyTimeoutMs;
+    xTaskCreatePinnedToCore(readyTask, "ModemReadyTask", 4096, this, 1, NULL, 1);
+    return true;
+}
+
+bool ModemHandler::waitUntilReady(int timeoutMs) {
+    TickType_t ticks = timeoutMs < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs);
+    xEventGroupWaitBits(readyEvents, MODEM_READY_DONE_BIT, pdFALSE, pdTRUE, ticks);
+    return isReady();
+}
+
+bool ModemHandler::isReady() const {
+    return (xEventGroupGetBits(readyEvents) & MODEM_READY_BIT) != 0;
+}
+
+void ModemHandler::readyTask(void* param) {
+    ModemHandler* handler = static_cast<ModemHandler*>(param);
+    handler->startUp(handler->readyTimeoutMs);
+    vTaskDelete(NULL);
+}
+
+bool ModemHandler::startUp(int timeoutMs) {
+    if (!detectReady(timeoutMs)) return false;
+    if (identityStore) identityStore->verify(*this);
+    return true;
+}
+
+void ModemHandler::setIdentityStore(ModemIdentityStore* store) {
+    this->identityStore = store;
+}
+
+bool ModemHandler::detectReady(int timeoutMs) {
+    // Probe with AT until the modem answers, backing off from a short interval
+    // so a quick boot is noticed early without flooding a slow one. A booting
+    // modem no longer owes anything to commands sent before.
+    clearOwedResults();
+    bool ready = false;
+    int interval = READY_PROBE_MIN_INTERVAL_MS;
+    unsigned long startTime = millis();
+    for (int attempt = 0; millis() - startTime < (unsigned long)timeoutMs; attempt++) {
+        if (probeReady(READY_PROBE_TIMEOUT_MS)) {
+            // Let answers to earlier probes arrive before the next command drains.
+            if (attempt > 0) delay(READY_PROBE_TIMEOUT_MS);
+            ready = true;
+            break;
+        }
+        delay(interval);
+        interval = min(interval * 2, READY_PROBE_MAX_INTERVAL_MS);
+    }
+    xEventGroupSetBits(readyEvents, ready ? (MODEM_READY_BIT | MODEM_READY_DONE_BIT) : MODEM_READY_DONE_BIT);
+    return ready;
+}
+
+bool ModemHandler::probeReady(int timeoutMs) {
+    // Unlike a regular command, an unanswered probe is not marked abandoned:
+    // a late OK from a booting modem only means it is ready, and beginCommand()
+    // drains it before the next probe or command.
+    CommandLock commandLock(*this);
+    beginCommand();
+    writeCommand("AT");
+
+    String response;
+    unsigned long startTime = millis();
+    while (millis() - startTime < (unsigned long)timeoutMs) {
+        if (!getResponse(response, timeoutMs)) break;
+        if (response == "OK") return true;
+    }
+    return false;
+}
+
+void ModemHandler::setReceiveMode(ReceiveMode mode, uart_port_t uartNum) {
+    this->receiveMode = mode;
+    this->uartNum = uartNum;
+}
+
+void ModemHandler::setOverlongLinePolicy(OverlongLinePolicy policy) {
+    this->overlongLinePolicy = policy;
+}
+
+size_t ModemHandler::getLineBufferSize() const {
+    return lineBufferSize;
+}
+
+uint32_t ModemHandler::getOverlongLineCount() const {
+    return overlongLineCount;
+}
+
+uint32_t ModemHandler::getLinePoolExhaustedCount() const {
+    return linePoolExhaustedCount;
+}
+
+uint32_t ModemHandler::getDroppedLineCount() const {
+    return responseQueue.stats.dropped + asyncEventQueue.stats.dropped;
+}
+
+void ModemHandler::setQueueOverflowPolicy(LineQueue queue, OverflowPolicy policy, int blockTimeoutMs) {
+    LineQueueState& state = queue == LineQueue::Response ? responseQueue : asyncEventQueue;
+    state.policy = policy;
+    state.blockTimeoutMs = blockTimeoutMs;
+}
+
+ModemHandler::QueueStats ModemHandler::getQueueStats(LineQueue queue) const {
+    return queue == LineQueue::Response ? responseQueue.stats : asyncEventQueue.stats;
+}
+
+uint32_t ModemHandler::getLateLineCount() const {
+    return lateLineCount;
 }
 
 void ModemHandler::setEnablePrompt(char chr) {
     this->promptCharacter = chr;
     this->enablePrompt = true;
+    updatePatternDetection();
 }
 
 void ModemHandler::setDisablePrompt() {
     this->enablePrompt = false;
+    updatePatternDetection();
+}
+
+bool ModemHandler::isPromptEnabled() const {
+    return enablePrompt;
+}
+
+char ModemHandler::getPromptCharacter() const {
+    return promptCharacter;
+}
+
+void ModemHandler::updatePatternDetection() {
+    if (!uartEventQueue) return;
+    // The UART can only detect a single pattern character, so while a prompt is
+    // expected it replaces the line terminator (the prompt is not followed by one).
+    char pattern = enablePrompt ? promptCharacter : '\n';
+    uart_disable_pattern_det_intr(uartNum);
+    uart_enable_pattern_det_baud_intr(uartNum, pattern, 1, 1, 0, 0);
+    uart_pattern_queue_reset(uartNum, UART_EVENT_QUEUE_SIZE);
 }
 
 void ModemHandler::setPins(int powerPin, int pwrOnPin, int rxPin, int txPin,
@@ -35,37 +243,363 @@ void ModemHandler::setPins(int powerPin, int pwrOnPin, int rxPin, int txPin,
 }
 
 void ModemHandler::sendATCommand(const String& command) {
-    if (debugMode) debugPrint("TX", command);
-    serial->println(command);
+    // A raw command starts a new exchange; its lines are read with getResponses().
+    if (directLinkActive) return;
+    CommandLock commandLock(*this);
+    beginCommand();
+    writeCommand(command);
+}
+
+void ModemHandler::writeCommand(const String& command) {
+    // In direct link mode everything sent would go to the socket.
+    if (directLinkActive) return;
+    portENTER_CRITICAL(&staleLock);
+    awaitingResult = true;
+    portEXIT_CRITICAL(&staleLock);
+    if (debugMode) debugPrint("TX", command.c_str(), command.length());
+    writeToModem(command.c_str(), command.length());
+    writeToModem("\r\n", 2);
 }
 
 void ModemHandler::sendStringData(const String& data) {
-    if (debugMode) debugPrint("TX", data);
-    serial->print(data);
+    write(reinterpret_cast<const uint8_t*>(data.c_str()), data.length());
+}
+
+size_t ModemHandler::write(const uint8_t* data, size_t length, int timeoutMs) {
+    // Data follows a prompt, so the link is awake; a wake-up AT here would end
+    // up in the payload.
+    if (debugMode) debugPrint("TX", reinterpret_cast<const char*>(data), length);
+    // Hand the driver no more than its TX buffer can take, so a CTS stall shows
+    // up as a full buffer here instead of blocking inside the driver.
+    size_t written = 0;
+    unsigned long lastProgress = millis();
+    while (written < length) {
+        size_t space = txSpaceAvailable();
+        if (space == 0) {
+            if (millis() - lastProgress >= (unsigned long)timeoutMs) break;
+            delay(1);
+            continue;
+        }
+        size_t chunkLength = min(min(space, length - written), UART_WRITE_CHUNK_SIZE);
+        writeToModem(reinterpret_cast<const char*>(data) + written, chunkLength);
+        written += chunkLength;
+        lastProgress = millis();
+    }
+    return written;
+}
+
+size_t ModemHandler::txSpaceAvailable() {
+    if (uartEventQueue) {
+        size_t space = 0;
+        uart_get_tx_buffer_free_size(uartNum, &space);
+        return space;
+    }
+    int space = serial->availableForWrite();
+    return space > 0 ? space : 0;
+}
+
+void ModemHandler::writeToModem(const char* data, size_t length) {
+    if (uartEventQueue) {
+        uart_write_bytes(uartNum, data, length);
+    } else {
+        serial->write(reinterpret_cast<const uint8_t*>(data), length);
+    }
 }
 
 bool ModemHandler::getResponse(String& response, int timeoutMs) {
-    String* responsePtr = nullptr;
-    if (xQueueReceive(responseQueue, &responsePtr, pdMS_TO_TICKS(timeoutMs)) == pdTRUE) {
-        response = *responsePtr;
-        delete responsePtr;
-        return true;
+    uint16_t index;
+    unsigned long startTime = millis();
+    unsigned long elapsed = 0;
+    while (dequeueLine(responseQueue, index, pdMS_TO_TICKS(timeoutMs - elapsed))) {
+        if (lineSlabs[index].sequence == rxSequence) {
+            takeLine(index, response);
+            return true;
+        }
+        lateLineCount++;
+        releaseSlab(index);
+        elapsed = millis() - startTime;
+        if (elapsed >= (unsigned long)timeoutMs) break;
     }
     return false;
 }
 
 bool ModemHandler::getAsyncEvent(String& event, int timeoutMs) {
-    String* eventPtr = nullptr;
-    if (xQueueReceive(asyncEventQueue, &eventPtr, pdMS_TO_TICKS(timeoutMs)) == pdTRUE) {
-        event = *eventPtr;
-        delete eventPtr;
+    uint16_t index;
+    if (dequeueLine(asyncEventQueue, index, pdMS_TO_TICKS(timeoutMs))) {
+        takeLine(index, event);
         return true;
     }
     return false;
 }
 
+void ModemHandler::takeLine(uint16_t index, String& line) {
+    const LineSlab& slab = lineSlabs[index];
+    line = "";
+    line.concat(slab.data, slab.length);
+    releaseSlab(index);
+}
+
+bool ModemHandler::dequeueLine(LineQueueState& queue, uint16_t& index, TickType_t ticks) {
+    if (xQueueReceive(queue.handle, &index, ticks) != pdTRUE) return false;
+    // Once its owner is cleared the reader no longer coalesces into this slab.
+    xSemaphoreTake(slabMutex, portMAX_DELAY);
+    lineSlabs[index].owner = nullptr;
+    xSemaphoreGive(slabMutex);
+    return true;
+}
+
+bool ModemHandler::takeFreeSlab(size_t length, uint16_t& index) {
+    // Short lines fall back to a large slab when the small ones are used up.
+    if (length <= min(SMALL_SLAB_SIZE, lineBufferSize) && xQueueReceive(freeSlabQueue, &index, 0) == pdTRUE) {
+        return true;
+    }
+    if (xQueueReceive(freeLargeSlabQueue, &index, 0) == pdTRUE) return true;
+    linePoolExhaustedCount++;
+    return false;
+}
+
+void ModemHandler::releaseSlab(uint16_t index) {
+    xQueueSend(lineSlabs[index].large ? freeLargeSlabQueue : freeSlabQueue, &index, 0);
+}
+
 void ModemHandler::setAsyncResponsePrefixes(const std::vector<String>& prefixes) {
-    asyncResponsePrefixes = prefixes;
+    xSemaphoreTakeRecursive(urcMutex, portMAX_DELAY);
+    // Prefixes that have a handler or a dedicated queue stay registered.
+    std::vector<String> newPrefixes = prefixes;
+    std::vector<UrcRoute> newRoutes(prefixes.size(), UrcRoute{nullptr, nullptr});
+    for (size_t i = 0; i < urcRoutes.size(); i++) {
+        const UrcRoute& route = urcRoutes[i];
+        if (!route.handler && !route.queue) continue;
+        auto it = std::find(newPrefixes.begin(), newPrefixes.end(), asyncResponsePrefixes[i]);
+        if (it == newPrefixes.end()) {
+            newPrefixes.push_back(asyncResponsePrefixes[i]);
+            newRoutes.push_back(route);
+        } else {
+            newRoutes[it - newPrefixes.begin()] = route;
+        }
+    }
+    asyncResponsePrefixes = newPrefixes;
+    urcRoutes = newRoutes;
+    compileAsyncPrefixes();
+    xSemaphoreGiveRecursive(urcMutex);
+}
+
+bool ModemHandler::setUrcHandler(const String& prefix, UrcHandler handler, int queueSize) {
+    // Dedicated queues get their own slabs, which can only be added before the reader runs.
+    if (queueSize > 0 && started) return false;
+
+    xSemaphoreTakeRecursive(urcMutex, portMAX_DELAY);
+    int index = findAsyncPrefix(prefix);
+    if (index == -1) {
+        asyncResponsePrefixes.push_back(prefix);
+        urcRoutes.push_back(UrcRoute{nullptr, nullptr});
+        compileAsyncPrefixes();
+        index = asyncResponsePrefixes.size() - 1;
+    }
+    UrcRoute& route = urcRoutes[index];
+    route.handler = handler;
+    if (queueSize > 0 && !route.queue) {
+        route.queue = new LineQueueState();
+        initLineQueue(*route.queue, queueSize);
+        growLinePool(queueSize);
+    }
+    xSemaphoreGiveRecursive(urcMutex);
+    return true;
+}
+
+bool ModemHandler::getUrc(const String& prefix, String& params, int timeoutMs) {
+    xSemaphoreTakeRecursive(urcMutex, portMAX_DELAY);
+    int index = findAsyncPrefix(prefix);
+    LineQueueState* queue = index == -1 ? nullptr : urcRoutes[index].queue;
+    xSemaphoreGiveRecursive(urcMutex);
+    if (!queue) return false;
+
+    uint16_t slabIndex;
+    if (!dequeueLine(*queue, slabIndex, pdMS_TO_TICKS(timeoutMs))) return false;
+    takeUrcParams(slabIndex, params);
+    return true;
+}
+
+bool ModemHandler::waitForUrc(const String& prefix, String& event, int timeoutMs) {
+    // Only lines recognized as URCs reach waiters; adding the prefix here
+    // would take solicited replies with the same prefix away from commands.
+    xSemaphoreTakeRecursive(urcMutex, portMAX_DELAY);
+    int prefixIndex = matchAsyncPrefix(prefix.c_str(), prefix.length());
+    if (prefixIndex == -1) {
+        xSemaphoreGiveRecursive(urcMutex);
+        return false;
+    }
+    LineQueueState& queue = urcRoutes[prefixIndex].queue ? *urcRoutes[prefixIndex].queue : asyncEventQueue;
+
+    // A matching URC may already be queued; otherwise the reader hands the
+    // next one straight to this waiter and it never enters a queue.
+    uint16_t index;
+    if (takeQueuedUrc(queue, prefix, index)) {
+        xSemaphoreGiveRecursive(urcMutex);
+        takeLine(index, event);
+        return true;
+    }
+    UrcWaiter waiter = {&prefix, xSemaphoreCreateBinary(), -1};
+    urcWaiters.push_back(&waiter);
+    xSemaphoreGiveRecursive(urcMutex);
+
+    xSemaphoreTake(waiter.ready, pdMS_TO_TICKS(timeoutMs));
+
+    xSemaphoreTakeRecursive(urcMutex, portMAX_DELAY);
+    urcWaiters.erase(std::remove(urcWaiters.begin(), urcWaiters.end(), &waiter), urcWaiters.end());
+    xSemaphoreGiveRecursive(urcMutex);
+    vSemaphoreDelete(waiter.ready);
+
+    if (waiter.slabIndex == -1) return false;
+    takeLine(waiter.slabIndex, event);
+    return true;
+}
+
+bool ModemHandler::takeQueuedUrc(LineQueueState& queue, const String& prefix, uint16_t& index) {
+    // Rotate the queue once, keeping the first match out and putting every
+    // other line back in its original order. The reader cannot enqueue while
+    // urcMutex is held.
+    bool found = false;
+    int waiting = uxQueueMessagesWaiting(queue.handle);
+    for (int i = 0; i < waiting; i++) {
+        uint16_t candidate;
+        if (!dequeueLine(queue, candidate, 0)) break;
+        const LineSlab& slab = lineSlabs[candidate];
+        if (!found && slab.length >= prefix.length() &&
+            memcmp(slab.data, prefix.c_str(), prefix.length()) == 0) {
+            index = candidate;
+            found = true;
+            continue;
+        }
+        xSemaphoreTake(slabMutex, portMAX_DELAY);
+        lineSlabs[candidate].owner = &queue;
+        xSemaphoreGive(slabMutex);
+        xQueueSend(queue.handle, &candidate, 0);
+    }
+    return found;
+}
+
+bool ModemHandler::handOffToWaiter(const char* line, size_t length, int prefixIndex) {
+    for (auto it = urcWaiters.begin(); it != urcWaiters.end(); ++it) {
+        UrcWaiter* waiter = *it;
+        const String& prefix = *waiter->prefix;
+        if (length < prefix.length() || memcmp(line, prefix.c_str(), prefix.length()) != 0) continue;
+
+        uint16_t index;
+        if (!takeFreeSlab(length, index)) return false;
+        LineSlab& slab = lineSlabs[index];
+        memcpy(slab.data, line, length);
+        slab.data[length] = '\0';
+        slab.length = length;
+        slab.payloadOffset = 0;
+        slab.payloadLength = 0;
+        slab.sequence = rxSequence;
+        slab.prefixIndex = prefixIndex;
+        slab.owner = nullptr;
+        waiter->slabIndex = index;
+        urcWaiters.erase(it);
+        xSemaphoreGive(waiter->ready);
+        return true;
+    }
+    return false;
+}
+
+void ModemHandler::takeUrcParams(uint16_t index, String& params) {
+    const LineSlab& slab = lineSlabs[index];
+    size_t offset = 0;
+    if (slab.prefixIndex >= 0 && slab.prefixIndex < (int)asyncResponsePrefixes.size()) {
+        offset = min((size_t)asyncResponsePrefixes[slab.prefixIndex].length(), slab.length);
+    }
+    while (offset < slab.length && slab.data[offset] == ' ') {
+        offset++;
+    }
+    params = "";
+    params.concat(slab.data + offset, slab.length - offset);
+    releaseSlab(index);
+}
+
+int ModemHandler::findAsyncPrefix(const String& prefix) const {
+    for (size_t i = 0; i < asyncResponsePrefixes.size(); i++) {
+        if (asyncResponsePrefixes[i] == prefix) return i;
+    }
+    return -1;
+}
+
+void ModemHandler::growLinePool(int count) {
+    // Dedicated URC queues only add small slabs; longer URCs share the large ones.
+    int oldCount = lineSlabs.size();
+    size_t smallSlabSize = min(SMALL_SLAB_SIZE, lineBufferSize);
+    char* storage = new char[count * (smallSlabSize + 1)];
+    QueueHandle_t freeQueue = xQueueCreate(oldCount - LINE_POOL_LARGE_SLABS + count, sizeof(uint16_t));
+    uint16_t index;
+    while (xQueueReceive(freeSlabQueue, &index, 0) == pdTRUE) {
+        xQueueSend(freeQueue, &index, 0);
+    }
+    lineSlabs.resize(oldCount + count);
+    for (uint16_t i = oldCount; i < oldCount + count; i++) {
+        lineSlabs[i].data = storage + (i - oldCount) * (smallSlabSize + 1);
+        lineSlabs[i].capacity = smallSlabSize;
+        lineSlabs[i].large = false;
+        lineSlabs[i].length = 0;
+        lineSlabs[i].owner = nullptr;
+        xQueueSend(freeQueue, &i, 0);
+    }
+    vQueueDelete(freeSlabQueue);
+    freeSlabQueue = freeQueue;
+}
+
+void ModemHandler::setPayloadResponsePrefixes(const std::vector<String>& prefixes) {
+    payloadResponsePrefixes = prefixes;
+}
+
+bool ModemHandler::isAsyncResponse(const String& line) const {
+    return matchAsyncPrefix(line.c_str(), line.length()) >= 0;
+}
+
+void ModemHandler::compileAsyncPrefixes() {
+    // Build a character trie (first-child / next-sibling links) so a line is
+    // classified in one walk over its leading characters.
+    std::vector<PrefixTrieNode> trie;
+    trie.push_back({'\0', -1, -1, -1});
+    for (size_t i = 0; i < asyncResponsePrefixes.size(); i++) {
+        const String& prefix = asyncResponsePrefixes[i];
+        int16_t node = 0;
+        for (size_t pos = 0; pos < prefix.length(); pos++) {
+            char c = prefix[pos];
+            int16_t child = trie[node].firstChild;
+            while (child != -1 && trie[child].character != c) {
+                child = trie[child].nextSibling;
+            }
+            if (child == -1) {
+                child = trie.size();
+                trie.push_back({c, -1, trie[node].firstChild, -1});
+                trie[node].firstChild = child;
+            }
+            node = child;
+        }
+        if (trie[node].prefixIndex == -1) {
+            trie[node].prefixIndex = i;
+        }
+    }
+    asyncPrefixTrie = trie;
+}
+
+int ModemHandler::matchAsyncPrefix(const char* line, size_t length) const {
+    if (asyncPrefixTrie.empty()) return -1;
+    int match = asyncPrefixTrie[0].prefixIndex;
+    int16_t node = 0;
+    for (size_t pos = 0; pos < length; pos++) {
+        int16_t child = asyncPrefixTrie[node].firstChild;
+        while (child != -1 && asyncPrefixTrie[child].character != line[pos]) {
+            child = asyncPrefixTrie[child].nextSibling;
+        }
+        if (child == -1) break;
+        node = child;
+        if (asyncPrefixTrie[node].prefixIndex != -1) {
+            match = asyncPrefixTrie[node].prefixIndex;
+        }
+    }
+    return match;
 }
 
 void ModemHandler::powerOnModem() {
@@ -80,72 +614,572 @@ void ModemHandler::powerOnModem() {
 }
 
 void ModemHandler::initSerial() {
-    serial->begin(115200, SERIAL_8N1, rxPin, txPin);
+    if (receiveMode == ReceiveMode::UartEvent) {
+        uart_config_t uart_config = {
+            .baud_rate = (int)baudRate,
+            .data_bits = UART_DATA_8_BITS,
+            .parity = UART_PARITY_DISABLE,
+            .stop_bits = UART_STOP_BITS_1,
+            .flow_ctrl = useFlowControl ? UART_HW_FLOWCTRL_CTS_RTS : UART_HW_FLOWCTRL_DISABLE,
+            .rx_flow_ctrl_thresh = 122,
+        };
+        uart_driver_install(uartNum, UART_RX_BUFFER_SIZE, UART_TX_BUFFER_SIZE,
+                            UART_EVENT_QUEUE_SIZE, &uartEventQueue, 0);
+        uart_param_config(uartNum, &uart_config);
+        if (useFlowControl) {
+            uart_set_pin(uartNum, txPin, rxPin, rtsPin, ctsPin);
+        } else {
+            uart_set_pin(uartNum, txPin, rxPin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+            pinMode(rtsPin, OUTPUT);
+            digitalWrite(rtsPin, LOW);
+        }
+        updatePatternDetection();
+        return;
+    }
+
+    serial->begin(baudRate, SERIAL_8N1, rxPin, txPin);
     if (useFlowControl) {
         uart_config_t uart_config = {
-            .baud_rate = 115200,
+            .baud_rate = (int)baudRate,
             .data_bits = UART_DATA_8_BITS,
             .parity = UART_PARITY_DISABLE,
             .stop_bits = UART_STOP_BITS_1,
             .flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS,
             .rx_flow_ctrl_thresh = 122,
         };
-        uart_param_config(UART_NUM_2, &uart_config);
-        uart_set_pin(UART_NUM_2, txPin, rxPin, rtsPin, ctsPin);
+        uart_param_config(uartNum, &uart_config);
+        uart_set_pin(uartNum, txPin, rxPin, rtsPin, ctsPin);
     } else {
         pinMode(rtsPin, OUTPUT);
         digitalWrite(rtsPin, LOW);
     }
 }
 
+bool ModemHandler::setBaudRate(uint32_t baudRate, int timeoutMs) {
+    // Before begin() this only selects the rate the modem is expected to use.
+    if (!started) {
+        this->baudRate = baudRate;
+        return true;
+    }
+    if (baudRate == this->baudRate) return true;
+
+    CommandLock commandLock(*this);
+    uint32_t previousRate = this->baudRate;
+    // Unanswered probes are not marked abandoned: at a rate the link cannot
+    // carry, their result codes never arrive.
+    auto probe = [&]() {
+        for (int attempt = 0; attempt < BAUD_RATE_PROBE_ATTEMPTS; attempt++) {
+            if (probeReady(timeoutMs)) return true;
+        }
+        return false;
+    };
+    std::vector<String> responses;
+    if (!sendATCommandWithResponse("AT+IPR=" + String(baudRate), &responses, timeoutMs) ||
+        responses.back() != "OK") {
+        return false;
+    }
+
+    // The modem answers OK at the old rate and then switches; follow it once
+    // the OK has been received and nothing is left in the TX FIFO.
+    delay(BAUD_RATE_SETTLE_MS);
+    applyBaudRate(baudRate);
+    if (probe()) return true;
+
+    // The new rate does not work on this link: ask the modem to go back
+    // (in case it did switch) and return to the previous rate.
+    sendATCommand("AT+IPR=" + String(previousRate));
+    delay(BAUD_RATE_SETTLE_MS);
+    applyBaudRate(previousRate);
+    probe();
+    return false;
+}
+
+uint32_t ModemHandler::getBaudRate() const {
+    return baudRate;
+}
+
+void ModemHandler::applyBaudRate(uint32_t baudRate) {
+    if (uartEventQueue) {
+        uart_wait_tx_done(uartNum, pdMS_TO_TICKS(BAUD_RATE_SETTLE_MS));
+        uart_set_baudrate(uartNum, baudRate);
+    } else {
+        serial->flush();
+        serial->updateBaudRate(baudRate);
+    }
+    this->baudRate = baudRate;
+    // Nothing sent at the old rate is answered at the new one.
+    clearOwedResults();
+}
+
+bool ModemHandler::setUartPowerSaving(UartPowerSaving mode, int idleFrames) {
+    // RTS-controlled mode needs the RTS line under software control.
+    if (mode == UartPowerSaving::RtsControlled && useFlowControl) return false;
+
+    CommandLock commandLock(*this);
+    String command = "AT+UPSV=";
+    switch (mode) {
+        case UartPowerSaving::Disabled: command += "0"; break;
+        case UartPowerSaving::IdleTimer: command += "1," + String(idleFrames); break;
+        case UartPowerSaving::RtsControlled: command += "2"; break;
+    }
+    std::vector<String> responses;
+    if (!sendATCommandWithResponse(command, &responses) || responses.back() != "OK") {
+        return false;
+    }
+
+    uartPowerSaving = mode;
+    // The idle timer counts GSM frames; treat the modem as asleep a little early.
+    long idleMs = (long)idleFrames * UPSV_FRAME_US / 1000 - UPSV_IDLE_MARGIN_MS;
+    uartIdleTimeoutMs = idleMs > 0 ? idleMs : 0;
+    if (mode != UartPowerSaving::RtsControlled && !useFlowControl) {
+        digitalWrite(rtsPin, LOW);
+        rtsReleased = false;
+    }
+    return true;
+}
+
+ModemHandler::UartPowerSaving ModemHandler::getUartPowerSaving() const {
+    return uartPowerSaving;
+}
+
+void ModemHandler::wakeModem() {
+    if (directLinkActive) return;
+    if (uartPowerSaving == UartPowerSaving::RtsControlled) {
+        if (rtsReleased) {
+            digitalWrite(rtsPin, LOW);
+            rtsReleased = false;
+            delay(UPSV_RTS_WAKE_MS);
+        }
+        return;
+    }
+    // Only what the modem sent proves it was awake; data sent to it may have
+    // been lost to its sleep.
+    if (uartPowerSaving != UartPowerSaving::IdleTimer || millis() - lastRxActivity < uartIdleTimeoutMs) {
+        return;
+    }
+
+    // A sleeping modem loses the characters that wake it up, so repeat a bare
+    // AT until it answers before the command goes out. The answers belong to
+    // the command's sequence and are drained with its stale lines.
+    CommandLock commandLock(*this);
+    String response;
+    for (int attempt = 0; attempt < UPSV_WAKE_ATTEMPTS; attempt++) {
+        writeToModem("AT\r\n", 4);
+        unsigned long startTime = millis();
+        while (millis() - startTime < UPSV_WAKE_TIMEOUT_MS) {
+            if (!getResponse(response, UPSV_WAKE_TIMEOUT_MS)) break;
+            if (response == "OK") {
+                // Let answers to earlier attempts arrive before the caller drains.
+                if (attempt > 0) delay(UPSV_WAKE_SETTLE_MS);
+                return;
+            }
+        }
+    }
+}
+
+bool ModemHandler::setPsm(bool enable, const String& periodicTau, const String& activeTime) {
+    CommandLock commandLock(*this);
+    std::vector<String> responses;
+    // +UUPSMR reports when the modem enters and leaves PSM.
+    if (!sendATCommandWithResponse(enable ? "AT+UPSMR=1" : "AT+UPSMR=0", &responses) ||
+        responses.back() != "OK") {
+        return false;
+    }
+    String command = enable ? "AT+CPSMS=1" : "AT+CPSMS=0";
+    if (enable && (periodicTau.length() > 0 || activeTime.length() > 0)) {
+        command += ",,,\"" + periodicTau + "\",\"" + activeTime + "\"";
+    }
+    return sendATCommandWithResponse(command, &responses) && responses.back() == "OK";
+}
+
+bool ModemHandler::setEdrx(bool enable, int accessTechnology, const String& edrxValue) {
+    String command = "AT+CEDRXS=" + String(enable ? 1 : 0) + "," + String(accessTechnology);
+    if (enable && edrxValue.length() > 0) {
+        command += ",\"" + edrxValue + "\"";
+    }
+    std::vector<String> responses;
+    return sendATCommandWithResponse(command, &responses) && responses.back() == "OK";
+}
+
+ModemHandler::PowerState ModemHandler::getPowerState() const {
+    return powerState;
+}
+
+void ModemHandler::onPowerSavingReport(const String& params) {
+    // Runs in the reader task: +UUPSMR: 1 means the modem entered PSM,
+    // anything else means it is (again) reachable.
+    powerState = params.toInt() == 1 ? PowerState::Sleeping : PowerState::Awake;
+}
+
+bool ModemHandler::wakeFromPsm(int timeoutMs) {
+    if (powerState != PowerState::Sleeping) return true;
+
+    // A modem in PSM only answers again after a PWR_ON pulse and a new boot,
+    // so readiness is detected the same way as after begin().
+    CommandLock commandLock(*this);
+    powerState = PowerState::Waking;
+    xEventGroupClearBits(readyEvents, MODEM_READY_BIT | MODEM_READY_DONE_BIT);
+    digitalWrite(pwrOnPin, LOW);
+    delay(PSM_WAKE_PULSE_MS);
+    digitalWrite(pwrOnPin, HIGH);
+    bool awake = detectReady(timeoutMs);
+    if (powerState == PowerState::Waking) {
+        powerState = awake ? PowerState::Awake : PowerState::Sleeping;
+    }
+    return awake;
+}
+
 void ModemHandler::readFromModemTask(void* param) {
     ModemHandler* handler = static_cast<ModemHandler*>(param);
+    if (handler->uartEventQueue) {
+        handler->readUartEvents();
+    }
+    uint8_t chunk[UART_READ_CHUNK_SIZE];
+    while (true) {
+        int available = handler->serial->available();
+        if (available > 0) {
+            size_t readLength = handler->serial->read(chunk, min((size_t)available, sizeof(chunk)));
+            handler->processChunk(reinterpret_cast<const char*>(chunk), readLength);
+        } else {
+            delay(10);
+        }
+    }
+}
+
+void ModemHandler::readUartEvents() {
+    uart_event_t event;
+    uint8_t chunk[UART_READ_CHUNK_SIZE];
     while (true) {
-        while (handler->serial->available()) {
-            char c = handler->serial->read();
-            if (c == '\r' || c == '\n') {
-                if (!handler->buffer.isEmpty()) {
-                    handler->processLine(handler->buffer);
-                    if (handler->debugMode) handler->debugPrint("RX", handler->buffer);
-                    handler->buffer = "";
+        if (xQueueReceive(uartEventQueue, &event, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        switch (event.type) {
+            case UART_PATTERN_DET:
+                uart_pattern_pop_pos(uartNum);
+                // fall through
+            case UART_DATA: {
+                size_t length = 0;
+                uart_get_buffered_data_len(uartNum, &length);
+                while (length > 0) {
+                    int readLength = uart_read_bytes(uartNum, chunk, min(length, sizeof(chunk)), 0);
+                    if (readLength <= 0) break;
+                    processChunk(reinterpret_cast<const char*>(chunk), readLength);
+                    length -= readLength;
                 }
-            } else if (c == handler->promptCharacter && handler->enablePrompt) {
-                handler->buffer += c;
-                handler->processLine(handler->buffer);
-                if (handler->debugMode) handler->debugPrint("RX", handler->buffer);
-                handler->buffer = "";
-            } else {
-                handler->buffer += c;
+                break;
+            }
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                uart_flush_input(uartNum);
+                xQueueReset(uartEventQueue);
+                lineLength = 0;
+                lineOverflowed = false;
+                lineQuoteCount = 0;
+                payloadRemaining = 0;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+void ModemHandler::processChunk(const char* data, size_t length) {
+    lastRxActivity = millis();
+    const char* end = data + length;
+    while (data < end) {
+        if (directLinkActive) {
+            data += processDirectLink(data, end - data);
+            continue;
+        }
+        if (payloadRemaining > 0) {
+            size_t copyLength = min(payloadRemaining, (size_t)(end - data));
+            appendToLine(data, copyLength);
+            payloadRemaining -= copyLength;
+            data += copyLength;
+            continue;
+        }
+        const char* stop = findLineStop(data, end - data);
+        if (!stop) {
+            appendToLine(data, end - data);
+            return;
+        }
+        if (*stop == '"') {
+            appendToLine(data, stop - data + 1);
+            startPayloadIfAnnounced();
+        } else {
+            appendToLine(data, stop - data);
+            if (*stop != '\r' && *stop != '\n') {
+                appendToLine(stop, 1);
             }
+            completeLine();
         }
-        delay(10);
+        data = stop + 1;
     }
 }
 
+const char* ModemHandler::findLineStop(const char* data, size_t length) const {
+    // Each memchr only searches up to the nearest stop found so far.
+    const char* stop = static_cast<const char*>(memchr(data, '\n', length));
+    size_t searchLength = stop ? stop - data : length;
+    const char* cr = static_cast<const char*>(memchr(data, '\r', searchLength));
+    if (cr) {
+        stop = cr;
+        searchLength = cr - data;
+    }
+    if (enablePrompt) {
+        const char* prompt = static_cast<const char*>(memchr(data, promptCharacter, searchLength));
+        if (prompt) {
+            stop = prompt;
+            searchLength = prompt - data;
+        }
+    }
+    const char* quote = static_cast<const char*>(memchr(data, '"', searchLength));
+    if (quote) stop = quote;
+    return stop;
+}
+
+void ModemHandler::appendToLine(const char* data, size_t length) {
+    while (length > 0) {
+        if (lineLength == lineBufferSize) {
+            if (!lineOverflowed) {
+                lineOverflowed = true;
+                overlongLineCount++;
+            }
+            if (overlongLinePolicy == OverlongLinePolicy::Truncate) {
+                return;
+            }
+            // Split: hand over what fits and keep assembling the rest as a new line.
+            emitLine();
+        }
+        size_t copyLength = min(length, lineBufferSize - lineLength);
+        memcpy(lineBuffer + lineLength, data, copyLength);
+        lineLength += copyLength;
+        data += copyLength;
+        length -= copyLength;
+    }
+}
+
+void ModemHandler::completeLine() {
+    if (lineLength > 0) {
+        emitLine();
+    }
+    lineOverflowed = false;
+    lineQuoteCount = 0;
+    linePayloadOffset = 0;
+    linePayloadLength = 0;
+}
+
+void ModemHandler::startPayloadIfAnnounced() {
+    // A counted payload is opened by the quote that follows ",<length>," in
+    // responses like +URDFILE: "name",<length>,"<data>" or +USORD: 0,<length>,"<data>".
+    // Its bytes are copied verbatim, CR/LF included, before line parsing resumes.
+    if (++lineQuoteCount % 2 == 0 || lineOverflowed || lineLength < 4) return;
+    size_t pos = lineLength - 2;
+    if (lineBuffer[pos] != ',') return;
+    size_t digitsEnd = pos;
+    while (pos > 0 && lineBuffer[pos - 1] >= '0' && lineBuffer[pos - 1] <= '9') {
+        pos--;
+    }
+    if (pos == digitsEnd || pos == 0 || lineBuffer[pos - 1] != ',') return;
+    if (!hasPayloadPrefix()) return;
+
+    size_t payloadLength = 0;
+    for (; pos < digitsEnd; pos++) {
+        payloadLength = payloadLength * 10 + (lineBuffer[pos] - '0');
+    }
+    payloadRemaining = payloadLength;
+    linePayloadOffset = lineLength;
+    linePayloadLength = payloadLength;
+}
+
+bool ModemHandler::hasPayloadPrefix() const {
+    for (const auto& prefix : payloadResponsePrefixes) {
+        if (lineLength >= prefix.length() && memcmp(lineBuffer, prefix.c_str(), prefix.length()) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void ModemHandler::emitLine() {
+    lineBuffer[lineLength] = '\0';
+    processLine(lineBuffer, lineLength);
+    if (debugMode) debugPrint("RX", lineBuffer, lineLength);
+    lineLength = 0;
+}
+
 void ModemHandler::setAsyncCallback(AsyncCallback callback) {
     asyncCallback = callback;
 }
 
-void ModemHandler::processLine(const String& line) {
-    String* linePtr = new String(line);
-
-    for (const auto& prefix : asyncResponsePrefixes) {
-        if (line.startsWith(prefix)) {
-            if (asyncCallback) {
-                asyncCallback(line);
+void ModemHandler::processLine(const char* line, size_t length) {
+    // From the byte after CONNECT on, the UART carries socket data.
+    if (directLinkPending && length == 7 && memcmp(line, "CONNECT", 7) == 0) {
+        directLinkPending = false;
+        directLinkSkipLf = true;
+        directLinkMatch = 0;
+        directLinkActive = true;
+    }
+    xSemaphoreTakeRecursive(urcMutex, portMAX_DELAY);
+    int prefixIndex = matchAsyncPrefix(line, length);
+    if (prefixIndex >= 0) {
+        const UrcRoute& route = urcRoutes[prefixIndex];
+        if (route.handler) {
+            size_t offset = asyncResponsePrefixes[prefixIndex].length();
+            while (offset < length && line[offset] == ' ') {
+                offset++;
             }
-            xQueueSend(asyncEventQueue, &linePtr, 0);
-            return;
+            String params;
+            params.concat(line + offset, length - offset);
+            route.handler(params);
+        }
+        if (asyncCallback) {
+            String event;
+            event.concat(line, length);
+            asyncCallback(event);
+        }
+        // A URC owned by a handler only goes to a queue if that handler has one.
+        if (handOffToWaiter(line, length, prefixIndex)) {
+            // Delivered to a task blocked in waitForUrc().
+        } else if (route.queue) {
+            enqueueLine(*route.queue, line, length, prefixIndex);
+        } else if (!route.handler) {
+            enqueueLine(asyncEventQueue, line, length, prefixIndex);
+        }
+        xSemaphoreGiveRecursive(urcMutex);
+        return;
+    }
+    xSemaphoreGiveRecursive(urcMutex);
+
+    // Everything up to the result codes still owed by commands that timed out
+    // is their late output; nobody is waiting for it. The standard result
+    // codes finish a command even if they are not in the end criteria. A
+    // prompt does not finish it, the result code follows the data.
+    bool prompt = enablePrompt && memchr(line, promptCharacter, length);
+    bool finished = isFinalResultCode(line, length, FINAL_RESULT_ALL) || (!prompt && isEndOfResponse(line, length));
+    bool late = false;
+    bool settled = false;
+    portENTER_CRITICAL(&staleLock);
+    if (owedResultCodes > 0) {
+        late = true;
+        settled = (finished || prompt) && --owedResultCodes == 0;
+    } else if (finished) {
+        awaitingResult = false;
+    }
+    portEXIT_CRITICAL(&staleLock);
+    if (late) {
+        lateLineCount++;
+        if (settled) xSemaphoreGive(abandonedSettled);
+        return;
+    }
+
+    enqueueLine(responseQueue, line, length);
+}
+
+void ModemHandler::enqueueLine(LineQueueState& queue, const char* line, size_t length, int prefixIndex) {
+    if (queue.policy == OverflowPolicy::Coalesce && uxQueueSpacesAvailable(queue.handle) == 0 &&
+        coalesceLine(queue, line, length, prefixIndex)) {
+        queue.stats.coalesced++;
+        return;
+    }
+
+    uint16_t index;
+    if (!takeFreeSlab(length, index)) {
+        queue.stats.dropped++;
+        return;
+    }
+    LineSlab& slab = lineSlabs[index];
+    memcpy(slab.data, line, length);
+    slab.data[length] = '\0';
+    slab.length = length;
+    slab.sequence = rxSequence;
+    slab.prefixIndex = prefixIndex;
+    slab.owner = &queue;
+    if (lineOverflowed || linePayloadOffset + linePayloadLength > length) {
+        slab.payloadOffset = 0;
+        slab.payloadLength = 0;
+    } else {
+        slab.payloadOffset = linePayloadOffset;
+        slab.payloadLength = linePayloadLength;
+    }
+
+    TickType_t ticks = queue.policy == OverflowPolicy::Block ? pdMS_TO_TICKS(queue.blockTimeoutMs) : 0;
+    bool queued = xQueueSend(queue.handle, &index, ticks) == pdTRUE;
+    if (!queued && queue.policy == OverflowPolicy::DropOldest) {
+        uint16_t oldest;
+        if (dequeueLine(queue, oldest, 0)) {
+            releaseSlab(oldest);
+            queue.stats.dropped++;
+        }
+        queued = xQueueSend(queue.handle, &index, 0) == pdTRUE;
+    }
+    if (!queued) {
+        slab.owner = nullptr;
+        queue.stats.dropped++;
+        releaseSlab(index);
+        return;
+    }
+    queue.stats.enqueued++;
+    uint32_t waiting = uxQueueMessagesWaiting(queue.handle);
+    if (waiting > queue.stats.highWaterMark) {
+        queue.stats.highWaterMark = waiting;
+    }
+}
+
+bool ModemHandler::coalesceLine(LineQueueState& queue, const char* line, size_t length, int prefixIndex) {
+    // Async events replace a queued event of the same URC family in place, so
+    // the consumer sees the latest state; a response identical to a queued one
+    // is dropped.
+    bool coalesced = false;
+    xSemaphoreTake(slabMutex, portMAX_DELAY);
+    for (auto& slab : lineSlabs) {
+        if (slab.owner != &queue) continue;
+        if (prefixIndex >= 0) {
+            if (slab.prefixIndex != prefixIndex || slab.capacity < length) continue;
+            memcpy(slab.data, line, length);
+            slab.data[length] = '\0';
+            slab.length = length;
+            slab.payloadOffset = 0;
+            slab.payloadLength = 0;
+            slab.sequence = rxSequence;
+            coalesced = true;
+            break;
+        }
+        if (slab.length == length && memcmp(slab.data, line, length) == 0) {
+            coalesced = true;
+            break;
         }
     }
+    xSemaphoreGive(slabMutex);
+    return coalesced;
+}
+
+bool ModemHandler::lock(int timeoutMs) {
+    TickType_t ticks = timeoutMs < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs);
+    if (xSemaphoreTakeRecursive(commandMutex, ticks) != pdTRUE) return false;
+    commandLockDepth++;
+    return true;
+}
 
-    xQueueSend(responseQueue, &linePtr, 0);
+void ModemHandler::unlock() {
+    // With RTS-controlled power saving the modem may sleep again once the
+    // outermost command sequence is done, but not between a prompt and the
+    // result code that follows the data.
+    if (--commandLockDepth == 0 && uartPowerSaving == UartPowerSaving::RtsControlled && !awaitingResult) {
+        digitalWrite(rtsPin, HIGH);
+        rtsReleased = true;
+    }
+    xSemaphoreGiveRecursive(commandMutex);
 }
 
 bool ModemHandler::sendATCommandWithResponse(const String& command, std::vector<String>* responses, int timeoutMs) {
-    if (!responses) return false;
+    if (!responses || directLinkActive) return false;
 
-    sendATCommand(command);
+    // Only the task holding the lock talks to the modem, so every line in
+    // responseQueue belongs to the command sent below.
+    CommandLock commandLock(*this);
+    beginCommand();
+    writeCommand(command);
 
     responses->clear();
     unsigned long startTime = millis();
@@ -162,15 +1196,364 @@ bool ModemHandler::sendATCommandWithResponse(const String& command, std::vector<
             break;
         }
     }
+    abandonCommand();
     return !responses->empty();
 }
 
+void ModemHandler::beginCommand() {
+    // Commands for a modem in PSM wait here until it has been woken up.
+    wakeFromPsm();
+    // Give commands that timed out a short grace period to finish before the
+    // modem gets new input; the reader discards their output meanwhile.
+    if (owedResultCodes > 0 &&
+        xSemaphoreTake(abandonedSettled, pdMS_TO_TICKS(STALE_RESPONSE_GUARD_MS)) != pdTRUE) {
+        resyncResponses();
+    }
+    rxSequence = ++commandSequence;
+    wakeModem();
+
+    uint16_t index;
+    while (dequeueLine(responseQueue, index, 0)) {
+        lateLineCount++;
+        releaseSlab(index);
+    }
+}
+
+void ModemHandler::abandonCommand() {
+    // The modem still owes the command its result code unless the reader has
+    // already seen it.
+    portENTER_CRITICAL(&staleLock);
+    bool owed = awaitingResult;
+    if (owed) {
+        owedResultCodes++;
+        awaitingResult = false;
+    }
+    portEXIT_CRITICAL(&staleLock);
+    if (owed) xSemaphoreTake(abandonedSettled, 0);
+}
+
+void ModemHandler::clearOwedResults() {
+    portENTER_CRITICAL(&staleLock);
+    owedResultCodes = 0;
+    awaitingResult = false;
+    portEXIT_CRITICAL(&staleLock);
+}
+
+void ModemHandler::resyncResponses() {
+    // The result codes still owed may never come (lost command, modem reset),
+    // so stop waiting for them and line up again on a bare AT: the modem
+    // answers in order, so nothing older is outstanding once its OK is in.
+    clearOwedResults();
+    rxSequence = ++commandSequence;
+    writeToModem("AT\r\n", 4);
+    String response;
+    int timeoutMs = STALE_RESYNC_TIMEOUT_MS;
+    while (getResponse(response, timeoutMs)) {
+        lateLineCount++;
+        // Keep reading briefly in case the OK belonged to an older command.
+        if (response == "OK") timeoutMs = STALE_RESYNC_SETTLE_MS;
+    }
+}
+
+ModemHandler::PendingCommand::PendingCommand(const String& command, CommandCallback callback, int timeoutMs)
+    : command(command), callback(callback), timeoutMs(timeoutMs), success(false),
+      resultCode(ResultCode::Timeout), done(false) {
+    doneSemaphore = xSemaphoreCreateBinary();
+}
+
+ModemHandler::PendingCommand::~PendingCommand() {
+    vSemaphoreDelete(doneSemaphore);
+}
+
+bool ModemHandler::PendingCommand::wait(int timeoutMs) {
+    if (done) return true;
+    TickType_t ticks = timeoutMs < 0 ? portMAX_DELAY : pdMS_TO_TICKS(timeoutMs);
+    if (xSemaphoreTake(doneSemaphore, ticks) != pdTRUE) return false;
+    // Hand the signal on to any other task waiting on the same command.
+    xSemaphoreGive(doneSemaphore);
+    return true;
+}
+
+std::shared_ptr<ModemHandler::PendingCommand> ModemHandler::sendATCommandAsync(const String& command,
+                                                                               CommandCallback callback,
+                                                                               int timeoutMs) {
+    // The executor task is started on first use. It has its own mutex, so
+    // this never waits for a command that holds the command lock.
+    xSemaphoreTake(executorMutex, portMAX_DELAY);
+    if (!executorStarted) {
+        executorStarted = xTaskCreatePinnedToCore(commandExecutorTask, "ModemCommandTask", 4096, this, 1, NULL, 1) ==
+                          pdPASS;
+    }
+    bool running = executorStarted;
+    xSemaphoreGive(executorMutex);
+    if (!running) return nullptr;
+
+    std::shared_ptr<PendingCommand> pending(new PendingCommand(command, callback, timeoutMs));
+    auto* queued = new std::shared_ptr<PendingCommand>(pending);
+    if (xQueueSend(commandQueue, &queued, 0) != pdTRUE) {
+        delete queued;
+        return nullptr;
+    }
+    return pending;
+}
+
+void ModemHandler::commandExecutorTask(void* param) {
+    ModemHandler* handler = static_cast<ModemHandler*>(param);
+    while (true) {
+        std::shared_ptr<PendingCommand>* queued = nullptr;
+        if (xQueueReceive(handler->commandQueue, &queued, portMAX_DELAY) != pdTRUE) {
+            continue;
+        }
+        std::shared_ptr<PendingCommand> pending = *queued;
+        delete queued;
+        // Commands queued during a non-blocking begin() run once the modem answers.
+        handler->waitUntilReady();
+        handler->executeCommand(*pending);
+    }
+}
+
+void ModemHandler::executeCommand(PendingCommand& pending) {
+    bool completed = sendATCommandWithResponse(pending.command, &pending.responses, pending.timeoutMs);
+    if (completed && !pending.responses.empty() && isEndOfResponse(pending.responses.back())) {
+        pending.resultCode = classifyResult(pending.responses.back());
+    } else {
+        pending.resultCode = ResultCode::Timeout;
+    }
+    pending.success = pending.resultCode == ResultCode::Ok || pending.resultCode == ResultCode::Prompt;
+    if (pending.callback) {
+        pending.callback(pending);
+    }
+    pending.done = true;
+    xSemaphoreGive(pending.doneSemaphore);
+}
+
+bool ModemHandler::readFile(const String& filename, ChunkSink sink, size_t chunkSize, int timeoutMs) {
+    CommandLock commandLock(*this);
+    std::vector<String> responses;
+    if (!sendATCommandWithResponse("AT+ULSTFILE=2,\"" + filename + "\"", &responses, timeoutMs)) {
+        return false;
+    }
+    long fileSize = -1;
+    for (const auto& response : responses) {
+        if (response.startsWith("+ULSTFILE: ")) {
+            fileSize = response.substring(11).toInt();
+        }
+    }
+    if (fileSize < 0) return false;
+
+    // A block plus its "+URDBLOCK: "<name>",<size>,"" header has to fit in one pooled line.
+    size_t headerLength = filename.length() + 24;
+    if (lineBufferSize <= headerLength) return false;
+    chunkSize = min(chunkSize, lineBufferSize - headerLength);
+
+    size_t offset = 0;
+    size_t requestedOffset = 0;
+    auto requestNextBlock = [&]() {
+        size_t length = min(chunkSize, (size_t)fileSize - requestedOffset);
+        writeCommand("AT+URDBLOCK=\"" + filename + "\"," + String(requestedOffset) + "," + String(length));
+        requestedOffset += length;
+    };
+
+    if (fileSize > 0) requestNextBlock();
+    while (offset < (size_t)fileSize) {
+        int block = -1;
+        if (!receiveFileBlock(block, timeoutMs)) {
+            abandonCommand();
+            return false;
+        }
+        const LineSlab& slab = lineSlabs[block];
+        // Request the next block before handing this one to the sink so the
+        // modem and the UART keep working while the sink runs.
+        bool pipelined = requestedOffset < (size_t)fileSize;
+        if (pipelined) requestNextBlock();
+        bool keepReading = sink(reinterpret_cast<const uint8_t*>(slab.data + slab.payloadOffset), slab.payloadLength);
+        offset += slab.payloadLength;
+        releaseSlab(block);
+        if (!keepReading) {
+            if (pipelined) {
+                if (receiveFileBlock(block, timeoutMs)) {
+                    releaseSlab(block);
+                } else {
+                    abandonCommand();
+                }
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ModemHandler::enterDirectLink(int socket, int timeoutMs) {
+    CommandLock commandLock(*this);
+    if (directLinkActive) return false;
+    if (!directLinkRing) {
+        directLinkRing = xRingbufferCreate(DIRECT_LINK_BUFFER_SIZE, RINGBUF_TYPE_BYTEBUF);
+        if (!directLinkRing) return false;
+    }
+
+    beginCommand();
+    directLinkPending = true;
+    writeCommand("AT+USODL=" + String(socket));
+    String response;
+    unsigned long startTime = millis();
+    while (millis() - startTime < (unsigned long)timeoutMs) {
+        if (!getResponse(response, timeoutMs)) break;
+        if (response == "CONNECT") {
+            lastDirectLinkWrite = millis();
+            return true;
+        }
+        if (isEndOfResponse(response)) {
+            directLinkPending = false;
+            return false;
+        }
+    }
+    directLinkPending = false;
+    if (directLinkActive) return true;
+    abandonCommand();
+    return false;
+}
+
+bool ModemHandler::exitDirectLink(int timeoutMs) {
+    if (!directLinkActive) return true;
+    // "+++" is only taken as the escape sequence with a guard time of
+    // silence before and after it; the modem then reports DISCONNECT.
+    unsigned long idle = millis() - lastDirectLinkWrite;
+    if (idle < (unsigned long)DIRECT_LINK_GUARD_MS) {
+        delay(DIRECT_LINK_GUARD_MS - idle);
+    }
+    xSemaphoreTake(directLinkClosed, 0);
+    writeToModem("+++", 3);
+    xSemaphoreTake(directLinkClosed, pdMS_TO_TICKS(DIRECT_LINK_GUARD_MS + timeoutMs));
+    return !directLinkActive;
+}
+
+bool ModemHandler::isDirectLink() const {
+    return directLinkActive;
+}
+
+size_t ModemHandler::writeDirectLink(const uint8_t* data, size_t length, int timeoutMs) {
+    if (!directLinkActive) return 0;
+    size_t written = write(data, length, timeoutMs);
+    lastDirectLinkWrite = millis();
+    return written;
+}
+
+size_t ModemHandler::readDirectLink(uint8_t* buffer, size_t length, int timeoutMs) {
+    // Data received before the link closed stays readable afterwards.
+    if (!directLinkRing) return 0;
+    size_t total = 0;
+    TickType_t ticks = pdMS_TO_TICKS(timeoutMs);
+    while (total < length) {
+        size_t itemSize = 0;
+        void* item = xRingbufferReceiveUpTo(directLinkRing, &itemSize, ticks, length - total);
+        if (!item) break;
+        memcpy(buffer + total, item, itemSize);
+        vRingbufferReturnItem(directLinkRing, item);
+        total += itemSize;
+        ticks = 0;
+    }
+    return total;
+}
+
+uint32_t ModemHandler::getDirectLinkDropCount() const {
+    return directLinkDropCount;
+}
+
+size_t ModemHandler::processDirectLink(const char* data, size_t length) {
+    // Pass everything through until "\r\nDISCONNECT". A partial match at the
+    // end of a chunk is held back and released if the next bytes differ.
+    static const char disconnect[] = "\r\nDISCONNECT";
+    static const size_t disconnectLength = sizeof(disconnect) - 1;
+
+    size_t pos = 0;
+    if (directLinkSkipLf) {
+        directLinkSkipLf = false;
+        if (length > 0 && data[0] == '\n') pos = 1;
+    }
+    while (pos < length) {
+        if (directLinkMatch == 0) {
+            const char* cr = static_cast<const char*>(memchr(data + pos, '\r', length - pos));
+            size_t runEnd = cr ? cr - data : length;
+            pushDirectLinkData(data + pos, runEnd - pos);
+            pos = runEnd;
+            if (!cr) break;
+        }
+        if (data[pos] == disconnect[directLinkMatch]) {
+            pos++;
+            if (++directLinkMatch == disconnectLength) {
+                directLinkMatch = 0;
+                directLinkActive = false;
+                xSemaphoreGive(directLinkClosed);
+                return pos;
+            }
+        } else {
+            pushDirectLinkData(disconnect, directLinkMatch);
+            directLinkMatch = 0;
+        }
+    }
+    return pos;
+}
+
+void ModemHandler::pushDirectLinkData(const char* data, size_t length) {
+    // Blocking here briefly lets hardware flow control hold off the modem
+    // while the application catches up.
+    if (length == 0) return;
+    if (xRingbufferSend(directLinkRing, data, length, pdMS_TO_TICKS(DIRECT_LINK_BLOCK_MS)) != pdTRUE) {
+        directLinkDropCount += length;
+    }
+}
+
+bool ModemHandler::receiveFileBlock(int& block, int timeoutMs) {
+    uint16_t index;
+    block = -1;
+    while (dequeueLine(responseQueue, index, pdMS_TO_TICKS(timeoutMs))) {
+        const LineSlab& slab = lineSlabs[index];
+        if (slab.length > 11 && memcmp(slab.data, "+URDBLOCK: ", 11) == 0 && block == -1) {
+            block = index;
+            continue;
+        }
+        bool ok = slab.length == 2 && memcmp(slab.data, "OK", 2) == 0;
+        bool end = ok || isEndOfResponse(slab.data, slab.length);
+        releaseSlab(index);
+        if (!end) continue;
+        if (ok && block != -1 && lineSlabs[block].payloadLength > 0) return true;
+        break;
+    }
+    if (block != -1) releaseSlab(block);
+    block = -1;
+    return false;
+}
+
 void ModemHandler::setResponseEndCriteria(const std::vector<String>& criteria) {
-    responseEndCriteria = criteria;
+    finalResultCodes = 0;
+    exactEndCriteria.clear();
+    prefixEndCriteria.clear();
+    for (const auto& criterion : criteria) {
+        int wildcard = criterion.indexOf('*');
+        if (wildcard == -1) {
+            if (criterion == "OK") {
+                finalResultCodes |= FINAL_RESULT_OK;
+            } else if (criterion == "ERROR") {
+                finalResultCodes |= FINAL_RESULT_ERROR;
+            } else {
+                exactEndCriteria.push_back(criterion);
+            }
+        } else {
+            String prefix = criterion.substring(0, wildcard);
+            if (prefix == "+CME ERROR:") {
+                finalResultCodes |= FINAL_RESULT_CME_ERROR;
+            } else if (prefix == "+CMS ERROR:") {
+                finalResultCodes |= FINAL_RESULT_CMS_ERROR;
+            } else {
+                prefixEndCriteria.push_back(prefix);
+            }
+        }
+    }
 }
 
 bool ModemHandler::getResponses(std::vector<String>* responses, int timeoutMs) {
     if (!responses) return false;
+    CommandLock commandLock(*this);
     responses->clear();
     String response;
     unsigned long startTime = millis();
@@ -185,29 +1568,63 @@ bool ModemHandler::getResponses(std::vector<String>* responses, int timeoutMs) {
             break;
         }
     }
+    abandonCommand();
     return false;
 }
 
 bool ModemHandler::isEndOfResponse(const String& line) {
-    if (enablePrompt && line.indexOf(promptCharacter) != -1) {
+    return isEndOfResponse(line.c_str(), line.length());
+}
+
+bool ModemHandler::isEndOfResponse(const char* line, size_t length) const {
+    if (enablePrompt && memchr(line, promptCharacter, length)) {
+        return true;
+    }
+    if (isFinalResultCode(line, length, finalResultCodes)) {
         return true;
     }
 
-    for (const auto& criteria : responseEndCriteria) {
-        if (criteria.indexOf('*') != -1) {
-            String prefix = criteria.substring(0, criteria.indexOf('*'));
-            if (line.startsWith(prefix)) {
-                return true;
-            }
-        } else {
-            if (line.equals(criteria)) {
-                return true;
-            }
+    for (const auto& criterion : exactEndCriteria) {
+        if (length == criterion.length() && memcmp(line, criterion.c_str(), length) == 0) {
+            return true;
+        }
+    }
+    for (const auto& prefix : prefixEndCriteria) {
+        if (length >= prefix.length() && memcmp(line, prefix.c_str(), prefix.length()) == 0) {
+            return true;
         }
     }
     return false;
 }
 
+ModemHandler::ResultCode ModemHandler::classifyResult(const String& line) const {
+    if (line == "OK") return ResultCode::Ok;
+    if (line == "ERROR") return ResultCode::Error;
+    if (line.startsWith("+CME ERROR:")) return ResultCode::CmeError;
+    if (line.startsWith("+CMS ERROR:")) return ResultCode::CmsError;
+    if (enablePrompt && line.indexOf(promptCharacter) != -1) return ResultCode::Prompt;
+    return ResultCode::Other;
+}
+
+bool ModemHandler::isFinalResultCode(const char* line, size_t length, uint8_t codes) const {
+    if (length < 2) return false;
+    switch (line[0]) {
+        case 'O':
+            return (codes & FINAL_RESULT_OK) && length == 2 && line[1] == 'K';
+        case 'E':
+            return (codes & FINAL_RESULT_ERROR) && length == 5 && memcmp(line, "ERROR", 5) == 0;
+        case '+':
+            if (length < 11 || memcmp(line, "+CM", 3) != 0 || memcmp(line + 4, " ERROR:", 7) != 0) {
+                return false;
+            }
+            if (line[3] == 'E') return codes & FINAL_RESULT_CME_ERROR;
+            if (line[3] == 'S') return codes & FINAL_RESULT_CMS_ERROR;
+            return false;
+        default:
+            return false;
+    }
+}
+
 void ModemHandler::enableDebugMode() {
     debugMode = true;
 }
@@ -216,7 +1633,58 @@ void ModemHandler::disableDebugMode() {
     debugMode = false;
 }
 
-void ModemHandler::debugPrint(const String& direction, const String& data) {
-    String timestamp = String(millis());
-    Serial.println("[" + timestamp + "] " + direction + ": " + data);
+void ModemHandler::enableTraceMode(size_t bufferSize) {
+    if (!traceRing) {
+        traceRing = xRingbufferCreate(bufferSize, RINGBUF_TYPE_NOSPLIT);
+        if (!traceRing) return;
+        xTaskCreatePinnedToCore(traceTask, "ModemTraceTask", 3072, this, 0, NULL, 1);
+    }
+    debugMode = true;
+}
+
+uint32_t ModemHandler::getTraceDropCount() const {
+    return traceDropCount;
+}
+
+void ModemHandler::debugPrint(const char* direction, const char* data, size_t length) {
+    if (traceRing) {
+        recordTrace(direction, data, length);
+        return;
+    }
+    Serial.printf("[%lu] %s: %.*s\r\n", millis(), direction, (int)length, data);
+}
+
+void ModemHandler::recordTrace(const char* direction, const char* data, size_t length) {
+    // Never blocks the caller: when the ring is full the record is dropped and counted.
+    size_t recordedLength = min(length, TRACE_MAX_DATA_LENGTH);
+    void* item = nullptr;
+    if (xRingbufferSendAcquire(traceRing, &item, sizeof(TraceRecord) + recordedLength, 0) != pdTRUE) {
+        traceDropCount++;
+        return;
+    }
+    TraceRecord* record = static_cast<TraceRecord*>(item);
+    record->timestamp = millis();
+    strncpy(record->direction, direction, sizeof(record->direction) - 1);
+    record->direction[sizeof(record->direction) - 1] = '\0';
+    record->length = min(length, (size_t)UINT16_MAX);
+    record->recordedLength = recordedLength;
+    memcpy(record + 1, data, recordedLength);
+    xRingbufferSendComplete(traceRing, item);
+}
+
+void ModemHandler::traceTask(void* param) {
+    ModemHandler* handler = static_cast<ModemHandler*>(param);
+    while (true) {
+        size_t itemSize = 0;
+        void* item = xRingbufferReceive(handler->traceRing, &itemSize, portMAX_DELAY);
+        if (!item) continue;
+        const TraceRecord* record = static_cast<const TraceRecord*>(item);
+        Serial.printf("[%lu] %s: %.*s", (unsigned long)record->timestamp, record->direction,
+                      (int)record->recordedLength, reinterpret_cast<const char*>(record + 1));
+        if (record->length > record->recordedLength) {
+            Serial.printf(" ... (%u bytes)", record->length);
+        }
+        Serial.print("\r\n");
+        vRingbufferReturnItem(handler->traceRing, item);
+    }
 }
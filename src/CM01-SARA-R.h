@@ -5,37 +5,295 @@
 
 #include <Arduino.h>
 #include "driver/uart.h"
+#include "freertos/ringbuf.h"
+#include "freertos/event_groups.h"
+#include <algorithm>
 #include <vector>
 #include <functional>
+#include <memory>
+
+class ModemIdentityStore;
 
 class ModemHandler {
 public:
     using AsyncCallback = std::function<void(const String&)>;
+    using ChunkSink = std::function<bool(const uint8_t* data, size_t length)>;
+    using UrcHandler = std::function<void(const String& params)>;
+
+    enum class ReceiveMode {
+        Polling,
+        UartEvent
+    };
+
+    enum class OverlongLinePolicy {
+        Split,
+        Truncate
+    };
+
+    enum class UartPowerSaving {
+        Disabled,
+        IdleTimer,
+        RtsControlled
+    };
+
+    enum class PowerState {
+        Awake,
+        Sleeping,
+        Waking
+    };
+
+    enum class LineQueue {
+        Response,
+        Async
+    };
+
+    enum class OverflowPolicy {
+        DropNewest,
+        DropOldest,
+        Block,
+        Coalesce
+    };
+
+    struct QueueStats {
+        uint32_t capacity;
+        uint32_t enqueued;
+        uint32_t dropped;
+        uint32_t coalesced;
+        uint32_t highWaterMark;
+    };
+
+    enum class ResultCode {
+        Ok,
+        Error,
+        CmeError,
+        CmsError,
+        Prompt,
+        Other,
+        Timeout
+    };
+
+    class PendingCommand;
+    using CommandCallback = std::function<void(const PendingCommand& command)>;
+
+    class PendingCommand {
+    public:
+        ~PendingCommand();
+        bool isDone() const { return done; }
+        bool wait(int timeoutMs = -1);
+        bool succeeded() const { return success; }
+        ResultCode getResultCode() const { return resultCode; }
+        const String& getCommand() const { return command; }
+        const std::vector<String>& getResponses() const { return responses; }
+
+    private:
+        friend class ModemHandler;
+        PendingCommand(const String& command, CommandCallback callback, int timeoutMs);
+
+        String command;
+        CommandCallback callback;
+        int timeoutMs;
+        std::vector<String> responses;
+        bool success;
+        ResultCode resultCode;
+        volatile bool done;
+        SemaphoreHandle_t doneSemaphore;
+    };
 
-    ModemHandler(HardwareSerial& serialPort, int responseQueueSize = 10, int asyncQueueSize = 10);
+    ModemHandler(HardwareSerial& serialPort, int responseQueueSize = 10, int asyncQueueSize = 10,
+                 size_t lineBufferSize = 1024);
 
-    void begin();
+    bool begin(bool waitForReady = true, int readyTimeoutMs = 20000);
+    bool waitUntilReady(int timeoutMs = -1);
+    bool isReady() const;
+    void setIdentityStore(ModemIdentityStore* store);
     void setPins(int powerPin = 5, int pwrOnPin = 4, int rxPin = 16, int txPin = 17,
                  int rtsPin = 18, int ctsPin = 19, bool useFlowControl = true);
+    bool setBaudRate(uint32_t baudRate, int timeoutMs = 1000);
+    uint32_t getBaudRate() const;
+    bool setUartPowerSaving(UartPowerSaving mode, int idleFrames = 2000);
+    UartPowerSaving getUartPowerSaving() const;
+    bool setPsm(bool enable, const String& periodicTau = "", const String& activeTime = "");
+    bool setEdrx(bool enable, int accessTechnology = 4, const String& edrxValue = "");
+    PowerState getPowerState() const;
+    bool wakeFromPsm(int timeoutMs = 10000);
     void sendATCommand(const String& command);
     void sendStringData(const String& data);
+    size_t write(const uint8_t* data, size_t length, int timeoutMs = 5000);
     bool getResponse(String& response, int timeoutMs = 5000);
     bool getAsyncEvent(String& event, int timeoutMs = 5000);
     bool getResponses(std::vector<String>* responses, int timeoutMs = 5000);
     void setResponseEndCriteria(const std::vector<String>& criteria);
     bool sendATCommandWithResponse(const String& command, std::vector<String>* responses, int timeoutMs = 5000);
+    std::shared_ptr<PendingCommand> sendATCommandAsync(const String& command, CommandCallback callback = nullptr,
+                                                       int timeoutMs = 5000);
+    bool readFile(const String& filename, ChunkSink sink, size_t chunkSize = 512, int timeoutMs = 5000);
+    bool enterDirectLink(int socket, int timeoutMs = 5000);
+    bool exitDirectLink(int timeoutMs = 5000);
+    bool isDirectLink() const;
+    size_t writeDirectLink(const uint8_t* data, size_t length, int timeoutMs = 5000);
+    size_t readDirectLink(uint8_t* buffer, size_t length, int timeoutMs = 0);
+    uint32_t getDirectLinkDropCount() const;
+    bool lock(int timeoutMs = -1);
+    void unlock();
     void setAsyncResponsePrefixes(const std::vector<String>& prefixes);
+    void setPayloadResponsePrefixes(const std::vector<String>& prefixes);
+    bool isAsyncResponse(const String& line) const;
+    bool setUrcHandler(const String& prefix, UrcHandler handler, int queueSize = 0);
+    bool getUrc(const String& prefix, String& params, int timeoutMs = 5000);
+    bool waitForUrc(const String& prefix, String& event, int timeoutMs = 5000);
     void setAsyncCallback(AsyncCallback callback);
+    void setReceiveMode(ReceiveMode mode, uart_port_t uartNum = UART_NUM_2);
+    void setOverlongLinePolicy(OverlongLinePolicy policy);
+    size_t getLineBufferSize() const;
+    uint32_t getOverlongLineCount() const;
+    uint32_t getLinePoolExhaustedCount() const;
+    uint32_t getDroppedLineCount() const;
+    void setQueueOverflowPolicy(LineQueue queue, OverflowPolicy policy, int blockTimeoutMs = 100);
+    QueueStats getQueueStats(LineQueue queue) const;
+    uint32_t getLateLineCount() const;
     void setEnablePrompt(char chr = '>');
     void setDisablePrompt();
+    bool isPromptEnabled() const;
+    char getPromptCharacter() const;
     void enableDebugMode();
     void disableDebugMode();
+    void enableTraceMode(size_t bufferSize = 4096);
+    uint32_t getTraceDropCount() const;
 
 private:
+    class CommandLock {
+    public:
+        CommandLock(ModemHandler& handler, int timeoutMs = -1)
+            : handler(handler), locked(handler.lock(timeoutMs)) {}
+        ~CommandLock() {
+            if (locked) handler.unlock();
+        }
+        bool isLocked() const { return locked; }
+
+    private:
+        ModemHandler& handler;
+        bool locked;
+    };
+
+    struct PrefixTrieNode {
+        char character;
+        int16_t firstChild;
+        int16_t nextSibling;
+        int16_t prefixIndex;
+    };
+
+    struct LineQueueState {
+        QueueHandle_t handle;
+        OverflowPolicy policy;
+        int blockTimeoutMs;
+        QueueStats stats;
+    };
+
+    struct UrcRoute {
+        UrcHandler handler;
+        LineQueueState* queue;
+    };
+
+    struct UrcWaiter {
+        const String* prefix;
+        SemaphoreHandle_t ready;
+        int slabIndex;
+    };
+
+    struct LineSlab {
+        char* data;
+        size_t capacity;
+        bool large;
+        size_t length;
+        size_t payloadOffset;
+        size_t payloadLength;
+        uint32_t sequence;
+        int16_t prefixIndex;
+        LineQueueState* owner;
+    };
+
+    enum FinalResultCode : uint8_t {
+        FINAL_RESULT_OK = 0x01,
+        FINAL_RESULT_ERROR = 0x02,
+        FINAL_RESULT_CME_ERROR = 0x04,
+        FINAL_RESULT_CMS_ERROR = 0x08,
+        FINAL_RESULT_ALL = 0x0F
+    };
+
+    struct TraceRecord {
+        uint32_t timestamp;
+        char direction[3];
+        uint16_t length;
+        uint16_t recordedLength;
+    };
+
+    static constexpr int LINE_POOL_SPARE = 2;
+    static constexpr int LINE_POOL_LARGE_SLABS = 4;
+    static constexpr size_t SMALL_SLAB_SIZE = 128;
+    static constexpr int COMMAND_QUEUE_SIZE = 10;
+    static constexpr int STALE_RESPONSE_GUARD_MS = 500;
+    static constexpr int STALE_RESYNC_TIMEOUT_MS = 300;
+    static constexpr int STALE_RESYNC_SETTLE_MS = 50;
+    static constexpr size_t TRACE_MAX_DATA_LENGTH = 256;
+    static constexpr EventBits_t MODEM_READY_BIT = 0x01;
+    static constexpr EventBits_t MODEM_READY_DONE_BIT = 0x02;
+    static constexpr int READY_PROBE_TIMEOUT_MS = 300;
+    static constexpr int READY_PROBE_MIN_INTERVAL_MS = 100;
+    static constexpr int READY_PROBE_MAX_INTERVAL_MS = 1000;
+    static constexpr int UPSV_FRAME_US = 4615;
+    static constexpr int UPSV_IDLE_MARGIN_MS = 100;
+    static constexpr int UPSV_WAKE_ATTEMPTS = 5;
+    static constexpr int UPSV_WAKE_TIMEOUT_MS = 100;
+    static constexpr int UPSV_WAKE_SETTLE_MS = 50;
+    static constexpr int UPSV_RTS_WAKE_MS = 20;
+    static constexpr int PSM_WAKE_PULSE_MS = 500;
+    static constexpr size_t DIRECT_LINK_BUFFER_SIZE = 4096;
+    static constexpr int DIRECT_LINK_GUARD_MS = 1000;
+    static constexpr int DIRECT_LINK_BLOCK_MS = 100;
+    static constexpr uint32_t DEFAULT_BAUD_RATE = 115200;
+    static constexpr int BAUD_RATE_PROBE_ATTEMPTS = 3;
+    static constexpr int BAUD_RATE_SETTLE_MS = 100;
+    static constexpr int UART_RX_BUFFER_SIZE = 2048;
+    static constexpr int UART_TX_BUFFER_SIZE = 1024;
+    static constexpr int UART_EVENT_QUEUE_SIZE = 20;
+    static constexpr size_t UART_READ_CHUNK_SIZE = 256;
+    static constexpr size_t UART_WRITE_CHUNK_SIZE = 256;
+
     HardwareSerial* serial;
-    String buffer;
-    QueueHandle_t responseQueue;
-    QueueHandle_t asyncEventQueue;
+    char* lineBuffer;
+    size_t lineBufferSize;
+    size_t lineLength;
+    bool lineOverflowed;
+    OverlongLinePolicy overlongLinePolicy;
+    uint32_t overlongLineCount;
+    int lineQuoteCount;
+    size_t payloadRemaining;
+    size_t linePayloadOffset;
+    size_t linePayloadLength;
+    LineQueueState responseQueue;
+    LineQueueState asyncEventQueue;
+    SemaphoreHandle_t commandMutex;
+    QueueHandle_t commandQueue;
+    SemaphoreHandle_t executorMutex;
+    bool executorStarted;
+    uint32_t commandSequence;
+    volatile uint32_t rxSequence;
+    uint32_t owedResultCodes;
+    bool awaitingResult;
+    portMUX_TYPE staleLock;
+    SemaphoreHandle_t abandonedSettled;
+    uint32_t lateLineCount;
+
+    std::vector<LineSlab> lineSlabs;
+    char* lineSlabStorage;
+    QueueHandle_t freeSlabQueue;
+    QueueHandle_t freeLargeSlabQueue;
+    SemaphoreHandle_t slabMutex;
+    uint32_t linePoolExhaustedCount;
+
+    ReceiveMode receiveMode;
+    uart_port_t uartNum;
+    QueueHandle_t uartEventQueue;
 
     int powerPin;
     int pwrOnPin;
@@ -44,23 +302,98 @@ private:
     int rtsPin;
     int ctsPin;
     bool useFlowControl;
+    uint32_t baudRate;
+    UartPowerSaving uartPowerSaving;
+    unsigned long uartIdleTimeoutMs;
+    volatile unsigned long lastRxActivity;
+    int commandLockDepth;
+    bool rtsReleased;
+    volatile PowerState powerState;
+    volatile bool directLinkPending;
+    volatile bool directLinkActive;
+    bool directLinkSkipLf;
+    size_t directLinkMatch;
+    unsigned long lastDirectLinkWrite;
+    RingbufHandle_t directLinkRing;
+    SemaphoreHandle_t directLinkClosed;
+    uint32_t directLinkDropCount;
+    EventGroupHandle_t readyEvents;
+    ModemIdentityStore* identityStore;
+    int readyTimeoutMs;
 
     bool enablePrompt;
     char promptCharacter;
 
     bool debugMode;
+    RingbufHandle_t traceRing;
+    uint32_t traceDropCount;
 
     std::vector<String> asyncResponsePrefixes;
-    std::vector<String> responseEndCriteria;
+    std::vector<PrefixTrieNode> asyncPrefixTrie;
+    std::vector<UrcRoute> urcRoutes;
+    std::vector<UrcWaiter*> urcWaiters;
+    SemaphoreHandle_t urcMutex;
+    bool started;
+    std::vector<String> payloadResponsePrefixes;
+    uint8_t finalResultCodes;
+    std::vector<String> exactEndCriteria;
+    std::vector<String> prefixEndCriteria;
 
     AsyncCallback asyncCallback;
     void powerOnModem();
     void initSerial();
+    void applyBaudRate(uint32_t baudRate);
+    void wakeModem();
+    void writeCommand(const String& command);
+    void onPowerSavingReport(const String& params);
+    bool detectReady(int timeoutMs);
+    bool startUp(int timeoutMs);
+    bool probeReady(int timeoutMs);
+    static void readyTask(void* param);
+    void updatePatternDetection();
+    void writeToModem(const char* data, size_t length);
+    size_t txSpaceAvailable();
     static void readFromModemTask(void* param);
-    void processLine(const String& line);
+    void readUartEvents();
+    void processChunk(const char* data, size_t length);
+    size_t processDirectLink(const char* data, size_t length);
+    void pushDirectLinkData(const char* data, size_t length);
+    const char* findLineStop(const char* data, size_t length) const;
+    void appendToLine(const char* data, size_t length);
+    void completeLine();
+    void startPayloadIfAnnounced();
+    bool hasPayloadPrefix() const;
+    void emitLine();
+    void compileAsyncPrefixes();
+    int findAsyncPrefix(const String& prefix) const;
+    void growLinePool(int count);
+    void takeUrcParams(uint16_t index, String& params);
+    bool takeQueuedUrc(LineQueueState& queue, const String& prefix, uint16_t& index);
+    bool handOffToWaiter(const char* line, size_t length, int prefixIndex);
+    int matchAsyncPrefix(const char* line, size_t length) const;
+    void processLine(const char* line, size_t length);
+    void enqueueLine(LineQueueState& queue, const char* line, size_t length, int prefixIndex = -1);
+    bool coalesceLine(LineQueueState& queue, const char* line, size_t length, int prefixIndex);
+    bool dequeueLine(LineQueueState& queue, uint16_t& index, TickType_t ticks);
+    void initLineQueue(LineQueueState& queue, int size);
+    void takeLine(uint16_t index, String& line);
+    bool receiveFileBlock(int& block, int timeoutMs);
+    bool takeFreeSlab(size_t length, uint16_t& index);
+    void releaseSlab(uint16_t index);
     bool isEndOfResponse(const String& line);
+    bool isEndOfResponse(const char* line, size_t length) const;
+    bool isFinalResultCode(const char* line, size_t length, uint8_t codes) const;
+    ResultCode classifyResult(const String& line) const;
+    void beginCommand();
+    void abandonCommand();
+    void resyncResponses();
+    void clearOwedResults();
+    static void commandExecutorTask(void* param);
+    void executeCommand(PendingCommand& pending);
     
-    void debugPrint(const String& direction, const String& data);
+    void debugPrint(const char* direction, const char* data, size_t length);
+    void recordTrace(const char* direction, const char* data, size_t length);
+    static void traceTask(void* param);
 };
 
 #endif // MODEM_HANDLER_H
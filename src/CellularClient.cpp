@@ -0,0 +1,127 @@
+#include <CellularClient.h>
+
+CellularClient::CellularClient(ModemSockets& sockets, int timeoutMs)
+    : sockets(&sockets), socket(-1), timeoutMs(timeoutMs), readStart(0), readEnd(0), writeLength(0) {}
+
+CellularClient::~CellularClient() {
+    stop();
+}
+
+int CellularClient::connect(IPAddress ip, uint16_t port) {
+    return connect(ip.toString().c_str(), port, timeoutMs);
+}
+
+int CellularClient::connect(const char* host, uint16_t port) {
+    return connect(host, port, timeoutMs);
+}
+
+int CellularClient::connect(IPAddress ip, uint16_t port, int32_t timeoutMs) {
+    return connect(ip.toString().c_str(), port, timeoutMs);
+}
+
+int CellularClient::connect(const char* host, uint16_t port, int32_t timeoutMs) {
+    stop();
+    // The previous socket could not be closed; opening another would leak it.
+    if (socket >= 0) return 0;
+    socket = sockets->open(ModemSockets::Protocol::Tcp, this->timeoutMs);
+    if (socket < 0) return 0;
+    if (!sockets->connect(socket, host, port, timeoutMs)) {
+        if (sockets->close(socket, this->timeoutMs)) socket = -1;
+        return 0;
+    }
+    return 1;
+}
+
+size_t CellularClient::write(uint8_t data) {
+    return write(&data, 1);
+}
+
+size_t CellularClient::write(const uint8_t* buffer, size_t size) {
+    // Small writes are collected and go out as one AT+USOWR once the buffer
+    // is full or the caller flushes, reads or stops.
+    if (socket < 0) return 0;
+    size_t written = 0;
+    while (written < size) {
+        if (writeLength == 0 && size - written >= WRITE_BUFFER_SIZE) {
+            size_t sent = sockets->write(socket, buffer + written, size - written, timeoutMs);
+            return written + sent;
+        }
+        size_t chunkLength = min(size - written, WRITE_BUFFER_SIZE - writeLength);
+        memcpy(writeBuffer + writeLength, buffer + written, chunkLength);
+        writeLength += chunkLength;
+        written += chunkLength;
+        if (writeLength == WRITE_BUFFER_SIZE && !flushWriteBuffer()) {
+            break;
+        }
+    }
+    return written;
+}
+
+int CellularClient::available() {
+    flushWriteBuffer();
+    if (socket < 0) return readEnd - readStart;
+    return readEnd - readStart + sockets->available(socket);
+}
+
+int CellularClient::read() {
+    uint8_t data;
+    return read(&data, 1) == 1 ? data : -1;
+}
+
+int CellularClient::read(uint8_t* buffer, size_t size) {
+    flushWriteBuffer();
+    if (readStart == readEnd && !fillReadBuffer()) return -1;
+    size_t length = min(size, readEnd - readStart);
+    memcpy(buffer, readBuffer + readStart, length);
+    readStart += length;
+    return length;
+}
+
+int CellularClient::peek() {
+    if (readStart == readEnd && !fillReadBuffer()) return -1;
+    return readBuffer[readStart];
+}
+
+void CellularClient::flush() {
+    flushWriteBuffer();
+}
+
+void CellularClient::stop() {
+    if (socket >= 0) {
+        flushWriteBuffer();
+        // The module has only a few sockets, so one it did not release is
+        // kept and closed again by the next stop() or connect().
+        if (sockets->close(socket, timeoutMs)) socket = -1;
+    }
+    readStart = readEnd = 0;
+    writeLength = 0;
+}
+
+uint8_t CellularClient::connected() {
+    flushWriteBuffer();
+    // Data that arrived before the peer closed can still be read.
+    if (readStart < readEnd) return 1;
+    return socket >= 0 && sockets->isConnected(socket);
+}
+
+CellularClient::operator bool() {
+    return socket >= 0;
+}
+
+bool CellularClient::fillReadBuffer() {
+    // Only ask the module for data once +UUSORD has announced some, and then
+    // fetch as much as fits, so byte-wise readers cost no extra commands.
+    if (socket < 0 || sockets->available(socket) == 0) return false;
+    int length = sockets->read(socket, readBuffer, READ_AHEAD_SIZE, timeoutMs);
+    readStart = 0;
+    readEnd = length > 0 ? length : 0;
+    return readEnd > 0;
+}
+
+bool CellularClient::flushWriteBuffer() {
+    if (writeLength == 0 || socket < 0) return true;
+    size_t sent = sockets->write(socket, writeBuffer, writeLength, timeoutMs);
+    memmove(writeBuffer, writeBuffer + sent, writeLength - sent);
+    writeLength -= sent;
+    return writeLength == 0;
+}
@@ -0,0 +1,50 @@
+
+// CellularClient.h
+#ifndef CELLULAR_CLIENT_H
+#define CELLULAR_CLIENT_H
+
+#include <Arduino.h>
+#include <Client.h>
+#include <IPAddress.h>
+#include "ModemSockets.h"
+
+class CellularClient : public Client {
+public:
+    CellularClient(ModemSockets& sockets, int timeoutMs = 5000);
+    ~CellularClient();
+
+    int connect(IPAddress ip, uint16_t port) override;
+    int connect(const char* host, uint16_t port) override;
+    int connect(IPAddress ip, uint16_t port, int32_t timeoutMs);
+    int connect(const char* host, uint16_t port, int32_t timeoutMs);
+    size_t write(uint8_t data) override;
+    size_t write(const uint8_t* buffer, size_t size) override;
+    int available() override;
+    int read() override;
+    int read(uint8_t* buffer, size_t size) override;
+    int peek() override;
+    void flush() override;
+    void stop() override;
+    uint8_t connected() override;
+    operator bool() override;
+
+    using Print::write;
+
+private:
+    static constexpr size_t READ_AHEAD_SIZE = 1024;
+    static constexpr size_t WRITE_BUFFER_SIZE = 1024;
+
+    ModemSockets* sockets;
+    int socket;
+    int timeoutMs;
+    uint8_t readBuffer[READ_AHEAD_SIZE];
+    size_t readStart;
+    size_t readEnd;
+    uint8_t writeBuffer[WRITE_BUFFER_SIZE];
+    size_t writeLength;
+
+    bool fillReadBuffer();
+    bool flushWriteBuffer();
+};
+
+#endif // CELLULAR_CLIENT_H
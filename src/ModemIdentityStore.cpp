@@ -0,0 +1,128 @@
+#include <ModemIdentityStore.h>
+#include <CM01-SARA-R.h>
+
+ModemIdentityStore::ModemIdentityStore(const char* nameSpace)
+    : nameSpace(nameSpace), loaded(false), verified(false) {
+    recordMutex = xSemaphoreCreateMutex();
+}
+
+bool ModemIdentityStore::load() {
+    if (!preferences.begin(nameSpace, true)) return false;
+    String storedImei = preferences.getString("imei");
+    String storedModel = preferences.getString("model");
+    String storedFirmwareVersion = preferences.getString("firmware");
+    String storedIccid = preferences.getString("iccid");
+    preferences.end();
+
+    xSemaphoreTake(recordMutex, portMAX_DELAY);
+    imei = storedImei;
+    model = storedModel;
+    firmwareVersion = storedFirmwareVersion;
+    iccid = storedIccid;
+    loaded = imei.length() > 0;
+    bool result = loaded;
+    xSemaphoreGive(recordMutex);
+    return result;
+}
+
+bool ModemIdentityStore::verify(ModemHandler& modem, int timeoutMs) {
+    // One round trip for all four values: the unprefixed lines come back in
+    // command order (IMEI, model, firmware), the ICCID carries +CCID:. Other
+    // prefixed lines are unsolicited reports that arrived in between.
+    const String command = "AT+CGSN;+CGMM;+CGMR;+CCID";
+    std::vector<String> responses;
+    if (!modem.sendATCommandWithResponse(command, &responses, timeoutMs) || responses.back() != "OK") {
+        return false;
+    }
+    std::vector<String> values;
+    String currentIccid;
+    for (const String& response : responses) {
+        if (response.length() == 0 || response == command || response == "OK") continue;
+        if (response.startsWith("+CCID:")) {
+            currentIccid = response.substring(6);
+            currentIccid.trim();
+        } else if (!response.startsWith("+")) {
+            values.push_back(response);
+        }
+    }
+    if (values.size() != 3 || !isImei(values[0])) return false;
+
+    // A different IMEI means another module; a new SIM or firmware changes
+    // the record for this one. Either way the record is replaced. This runs
+    // in the ready task while the application may read the getters.
+    xSemaphoreTake(recordMutex, portMAX_DELAY);
+    bool changed = !loaded || values[0] != imei || values[1] != model || values[2] != firmwareVersion ||
+                   currentIccid != iccid;
+    if (changed) {
+        imei = values[0];
+        model = values[1];
+        firmwareVersion = values[2];
+        iccid = currentIccid;
+    }
+    loaded = true;
+    verified = true;
+    xSemaphoreGive(recordMutex);
+    if (changed) save();
+    return true;
+}
+
+void ModemIdentityStore::clear() {
+    if (preferences.begin(nameSpace, false)) {
+        preferences.clear();
+        preferences.end();
+    }
+    xSemaphoreTake(recordMutex, portMAX_DELAY);
+    loaded = false;
+    verified = false;
+    imei = model = firmwareVersion = iccid = "";
+    xSemaphoreGive(recordMutex);
+}
+
+bool ModemIdentityStore::isLoaded() const {
+    return loaded;
+}
+
+bool ModemIdentityStore::isVerified() const {
+    return verified;
+}
+
+String ModemIdentityStore::getImei() const {
+    return getField(imei);
+}
+
+String ModemIdentityStore::getModel() const {
+    return getField(model);
+}
+
+String ModemIdentityStore::getFirmwareVersion() const {
+    return getField(firmwareVersion);
+}
+
+String ModemIdentityStore::getIccid() const {
+    return getField(iccid);
+}
+
+String ModemIdentityStore::getField(const String& field) const {
+    xSemaphoreTake(recordMutex, portMAX_DELAY);
+    String value = field;
+    xSemaphoreGive(recordMutex);
+    return value;
+}
+
+bool ModemIdentityStore::isImei(const String& value) {
+    if (value.length() != 15) return false;
+    for (size_t i = 0; i < value.length(); i++) {
+        if (!isDigit(value[i])) return false;
+    }
+    return true;
+}
+
+void ModemIdentityStore::save() {
+    // NVS is only written when something changed, to spare the flash.
+    if (!preferences.begin(nameSpace, false)) return;
+    preferences.putString("imei", getImei());
+    preferences.putString("model", getModel());
+    preferences.putString("firmware", getFirmwareVersion());
+    preferences.putString("iccid", getIccid());
+    preferences.end();
+}
@@ -0,0 +1,41 @@
+
+// ModemIdentityStore.h
+#ifndef MODEM_IDENTITY_STORE_H
+#define MODEM_IDENTITY_STORE_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+class ModemHandler;
+
+class ModemIdentityStore {
+public:
+    ModemIdentityStore(const char* nameSpace = "cm01-identity");
+
+    bool load();
+    bool verify(ModemHandler& modem, int timeoutMs = 5000);
+    void clear();
+    bool isLoaded() const;
+    bool isVerified() const;
+    String getImei() const;
+    String getModel() const;
+    String getFirmwareVersion() const;
+    String getIccid() const;
+
+private:
+    const char* nameSpace;
+    Preferences preferences;
+    SemaphoreHandle_t recordMutex;
+    bool loaded;
+    bool verified;
+    String imei;
+    String model;
+    String firmwareVersion;
+    String iccid;
+
+    String getField(const String& field) const;
+    static bool isImei(const String& value);
+    void save();
+};
+
+#endif // MODEM_IDENTITY_STORE_H
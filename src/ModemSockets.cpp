@@ -0,0 +1,229 @@
+#include <ModemSockets.h>
+
+// min() takes its arguments by reference, which needs these defined before C++17.
+constexpr size_t ModemSockets::MAX_WRITE_LENGTH;
+constexpr size_t ModemSockets::MAX_READ_LENGTH;
+
+ModemSockets::ModemSockets(ModemHandler& modem) : modem(&modem) {
+    for (auto& socket : sockets) {
+        socket = {false, false, Protocol::Tcp, 0};
+    }
+    socketEvents = xEventGroupCreate();
+    modem.setUrcHandler("+UUSORD:", [this](const String& params) { onDataReport(params); });
+    modem.setUrcHandler("+UUSORF:", [this](const String& params) { onDataReport(params); });
+    modem.setUrcHandler("+UUSOCL:", [this](const String& params) { onCloseReport(params); });
+}
+
+int ModemSockets::open(Protocol protocol, int timeoutMs) {
+    std::vector<String> responses;
+    if (!modem->sendATCommandWithResponse("AT+USOCR=" + String((int)protocol), &responses, timeoutMs) ||
+        responses.back() != "OK") {
+        return -1;
+    }
+    for (const auto& response : responses) {
+        if (!response.startsWith("+USOCR:")) continue;
+        int socket = response.substring(7).toInt();
+        if (!isValid(socket)) return -1;
+        sockets[socket] = {true, false, protocol, 0};
+        xEventGroupClearBits(socketEvents, (1 << socket) | (1 << (CLOSED_BIT_OFFSET + socket)));
+        return socket;
+    }
+    return -1;
+}
+
+bool ModemSockets::connect(int socket, const String& host, uint16_t port, int timeoutMs) {
+    if (!isOpen(socket)) return false;
+    std::vector<String> responses;
+    String command = "AT+USOCO=" + String(socket) + ",\"" + host + "\"," + String(port);
+    if (!modem->sendATCommandWithResponse(command, &responses, timeoutMs) || responses.back() != "OK") {
+        return false;
+    }
+    sockets[socket].connected = true;
+    return true;
+}
+
+size_t ModemSockets::write(int socket, const uint8_t* data, size_t length, int timeoutMs) {
+    if (!isConnected(socket)) return 0;
+    size_t written = 0;
+    while (written < length) {
+        size_t chunkLength = min(length - written, MAX_WRITE_LENGTH);
+        String command = "AT+USOWR=" + String(socket) + "," + String(chunkLength);
+        size_t accepted = sendData(command, data + written, chunkLength, timeoutMs);
+        written += accepted;
+        if (accepted < chunkLength) break;
+    }
+    return written;
+}
+
+size_t ModemSockets::writeTo(int socket, const String& host, uint16_t port, const uint8_t* data, size_t length,
+                             int timeoutMs) {
+    // A datagram cannot be split, so it has to fit in one binary write.
+    if (!isOpen(socket) || length > MAX_WRITE_LENGTH) return 0;
+    String command = "AT+USOST=" + String(socket) + ",\"" + host + "\"," + String(port) + "," + String(length);
+    return sendData(command, data, length, timeoutMs);
+}
+
+int ModemSockets::read(int socket, uint8_t* buffer, size_t length, int timeoutMs) {
+    if (!isOpen(socket)) return -1;
+    String command = "AT+USORD=" + String(socket) + ",";
+    return receiveData(socket, command, "+USORD:", buffer, length, nullptr, timeoutMs);
+}
+
+int ModemSockets::readFrom(int socket, uint8_t* buffer, size_t length, String& remoteHost, uint16_t& remotePort,
+                           int timeoutMs) {
+    if (!isOpen(socket)) return -1;
+    String header;
+    String command = "AT+USORF=" + String(socket) + ",";
+    int received = receiveData(socket, command, "+USORF:", buffer, length, &header, timeoutMs);
+    if (received < 0) return received;
+
+    // header is <socket>,"<ip>",<port>
+    int firstQuote = header.indexOf('"');
+    int secondQuote = header.indexOf('"', firstQuote + 1);
+    if (firstQuote != -1 && secondQuote != -1) {
+        remoteHost = header.substring(firstQuote + 1, secondQuote);
+        remotePort = header.substring(secondQuote + 2).toInt();
+    }
+    return received;
+}
+
+size_t ModemSockets::available(int socket) const {
+    return isValid(socket) ? sockets[socket].pending : 0;
+}
+
+bool ModemSockets::waitForData(int socket, int timeoutMs) {
+    if (!isOpen(socket)) return false;
+    if (sockets[socket].pending > 0) return true;
+    EventBits_t bits = (1 << socket) | (1 << (CLOSED_BIT_OFFSET + socket));
+    xEventGroupWaitBits(socketEvents, bits, pdFALSE, pdFALSE, pdMS_TO_TICKS(timeoutMs));
+    return sockets[socket].pending > 0;
+}
+
+bool ModemSockets::isOpen(int socket) const {
+    return isValid(socket) && sockets[socket].open;
+}
+
+bool ModemSockets::isConnected(int socket) const {
+    return isOpen(socket) && sockets[socket].connected;
+}
+
+bool ModemSockets::close(int socket, int timeoutMs) {
+    if (!isValid(socket)) return false;
+    if (!sockets[socket].open) return true;
+    // The socket stays open if the module did not release it, so close() can be retried.
+    std::vector<String> responses;
+    if (!modem->sendATCommandWithResponse("AT+USOCL=" + String(socket), &responses, timeoutMs) ||
+        responses.back() != "OK") {
+        return false;
+    }
+    sockets[socket].open = false;
+    sockets[socket].connected = false;
+    sockets[socket].pending = 0;
+    return true;
+}
+
+bool ModemSockets::isValid(int socket) const {
+    return socket >= 0 && socket < MAX_SOCKETS;
+}
+
+size_t ModemSockets::sendData(const String& command, const uint8_t* data, size_t length, int timeoutMs) {
+    // Binary writes are announced with the length and answered with an '@'
+    // prompt; the module needs a short pause after it before the data.
+    if (!modem->lock(timeoutMs)) return 0;
+    std::vector<String> responses;
+    bool promptEnabled = modem->isPromptEnabled();
+    char promptCharacter = modem->getPromptCharacter();
+    modem->setEnablePrompt('@');
+    bool prompted = modem->sendATCommandWithResponse(command, &responses, timeoutMs) &&
+                    responses.back().indexOf('@') != -1;
+    // Put back whatever prompt the application had set.
+    if (promptEnabled) {
+        modem->setEnablePrompt(promptCharacter);
+    } else {
+        modem->setDisablePrompt();
+    }
+
+    size_t accepted = 0;
+    if (prompted) {
+        delay(BINARY_PROMPT_DELAY_MS);
+        if (modem->write(data, length, timeoutMs) == length && modem->getResponses(&responses, timeoutMs) &&
+            responses.back() == "OK") {
+            for (const auto& response : responses) {
+                if (response.startsWith("+USOWR:") || response.startsWith("+USOST:")) {
+                    accepted = response.substring(response.lastIndexOf(',') + 1).toInt();
+                }
+            }
+        }
+    }
+    modem->unlock();
+    return accepted;
+}
+
+int ModemSockets::receiveData(int socket, const String& command, const String& prefix, uint8_t* buffer,
+                              size_t length, String* header, int timeoutMs) {
+    // The data comes back quoted inside a single response line, which has to
+    // fit into the modem handler's line buffer.
+    size_t lineBufferSize = modem->getLineBufferSize();
+    if (lineBufferSize <= READ_HEADER_LENGTH) return -1;
+    length = min(length, min(MAX_READ_LENGTH, lineBufferSize - READ_HEADER_LENGTH));
+
+    std::vector<String> responses;
+    if (!modem->sendATCommandWithResponse(command + String(length), &responses, timeoutMs) ||
+        responses.back() != "OK") {
+        return -1;
+    }
+
+    for (const auto& response : responses) {
+        if (!response.startsWith(prefix)) continue;
+        // <header>,<length>,"<data>": the length is the last field before the opening quote.
+        const char* line = response.c_str();
+        size_t lineLength = response.length();
+        const char* quote = static_cast<const char*>(memchr(line, '"', lineLength));
+        if (header) {
+            // readFrom: the data quote follows the quoted remote address.
+            quote = quote ? static_cast<const char*>(memchr(quote + 1, '"', lineLength - (quote + 1 - line))) : nullptr;
+            quote = quote ? static_cast<const char*>(memchr(quote + 1, '"', lineLength - (quote + 1 - line))) : nullptr;
+        }
+        if (!quote) {
+            // No data: "<socket>,0"
+            return 0;
+        }
+        String fields = response.substring(prefix.length(), quote - line - 1);
+        int lengthComma = fields.lastIndexOf(',');
+        size_t received = min((size_t)fields.substring(lengthComma + 1).toInt(), length);
+        if (quote + 1 + received > line + lineLength) return -1;
+        memcpy(buffer, quote + 1, received);
+        if (header) {
+            *header = fields.substring(0, lengthComma);
+            header->trim();
+        }
+
+        size_t pending = sockets[socket].pending;
+        sockets[socket].pending = pending > received ? pending - received : 0;
+        if (sockets[socket].pending == 0) {
+            xEventGroupClearBits(socketEvents, 1 << socket);
+        }
+        return received;
+    }
+    return -1;
+}
+
+void ModemSockets::onDataReport(const String& params) {
+    // Runs in the reader task: +UUSORD/+UUSORF: <socket>,<bytes available>
+    int comma = params.indexOf(',');
+    int socket = params.toInt();
+    if (comma == -1 || !isValid(socket)) return;
+    sockets[socket].pending = params.substring(comma + 1).toInt();
+    xEventGroupSetBits(socketEvents, 1 << socket);
+}
+
+void ModemSockets::onCloseReport(const String& params) {
+    // Runs in the reader task: +UUSOCL: <socket>
+    int socket = params.toInt();
+    if (!isValid(socket)) return;
+    // The module has already released the socket.
+    sockets[socket].open = false;
+    sockets[socket].connected = false;
+    sockets[socket].pending = 0;
+    xEventGroupSetBits(socketEvents, 1 << (CLOSED_BIT_OFFSET + socket));
+}
@@ -0,0 +1,60 @@
+
+// ModemSockets.h
+#ifndef MODEM_SOCKETS_H
+#define MODEM_SOCKETS_H
+
+#include <Arduino.h>
+#include "CM01-SARA-R.h"
+
+class ModemSockets {
+public:
+    enum class Protocol {
+        Tcp = 6,
+        Udp = 17
+    };
+
+    static constexpr int MAX_SOCKETS = 7;
+
+    ModemSockets(ModemHandler& modem);
+
+    int open(Protocol protocol, int timeoutMs = 5000);
+    bool connect(int socket, const String& host, uint16_t port, int timeoutMs = 30000);
+    size_t write(int socket, const uint8_t* data, size_t length, int timeoutMs = 5000);
+    size_t writeTo(int socket, const String& host, uint16_t port, const uint8_t* data, size_t length,
+                   int timeoutMs = 5000);
+    int read(int socket, uint8_t* buffer, size_t length, int timeoutMs = 5000);
+    int readFrom(int socket, uint8_t* buffer, size_t length, String& remoteHost, uint16_t& remotePort,
+                 int timeoutMs = 5000);
+    size_t available(int socket) const;
+    bool waitForData(int socket, int timeoutMs);
+    bool isOpen(int socket) const;
+    bool isConnected(int socket) const;
+    bool close(int socket, int timeoutMs = 10000);
+
+private:
+    struct SocketState {
+        bool open;
+        bool connected;
+        Protocol protocol;
+        volatile size_t pending;
+    };
+
+    static constexpr size_t MAX_WRITE_LENGTH = 1024;
+    static constexpr size_t MAX_READ_LENGTH = 1024;
+    static constexpr size_t READ_HEADER_LENGTH = 48;
+    static constexpr int BINARY_PROMPT_DELAY_MS = 50;
+    static constexpr EventBits_t CLOSED_BIT_OFFSET = 8;
+
+    ModemHandler* modem;
+    SocketState sockets[MAX_SOCKETS];
+    EventGroupHandle_t socketEvents;
+
+    bool isValid(int socket) const;
+    size_t sendData(const String& command, const uint8_t* data, size_t length, int timeoutMs);
+    int receiveData(int socket, const String& command, const String& prefix, uint8_t* buffer, size_t length,
+                    String* header, int timeoutMs);
+    void onDataReport(const String& params);
+    void onCloseReport(const String& params);
+};
+
+#endif // MODEM_SOCKETS_H
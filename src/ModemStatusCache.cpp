@@ -0,0 +1,188 @@
+#include <ModemStatusCache.h>
+
+ModemStatusCache::ModemStatusCache(ModemHandler& modem, int ttlMs, ModemIdentityStore* identityStore)
+    : modem(&modem), identityStore(identityStore), ttlMs(ttlMs), registrationUrc(false) {
+    cacheMutex = xSemaphoreCreateMutex();
+    for (CachedValue* cached : {&imei, &iccid, &firmwareVersion, &signalQuality, &registrationStatus}) {
+        cached->revision = 0;
+    }
+    invalidate();
+    useIdentityStore = identityStore != nullptr;
+}
+
+bool ModemStatusCache::getImei(String& imei) {
+    return getIdentity(this->imei, &ModemIdentityStore::getImei, "AT+CGSN", "", imei);
+}
+
+bool ModemStatusCache::getIccid(String& iccid) {
+    return getIdentity(this->iccid, &ModemIdentityStore::getIccid, "AT+CCID", "+CCID:", iccid);
+}
+
+bool ModemStatusCache::getFirmwareVersion(String& version) {
+    return getIdentity(firmwareVersion, &ModemIdentityStore::getFirmwareVersion, "AT+CGMR", "", version);
+}
+
+bool ModemStatusCache::getSignalQuality(int& rssi, int& ber) {
+    String value;
+    if (!getMutable(signalQuality, "AT+CSQ", "+CSQ:", value)) return false;
+    int comma = value.indexOf(',');
+    if (comma == -1) return false;
+    rssi = value.substring(0, comma).toInt();
+    ber = value.substring(comma + 1).toInt();
+    return true;
+}
+
+bool ModemStatusCache::getRegistrationStatus(int& status) {
+    String value;
+    if (!readCached(registrationStatus, true, value) && !queryRegistration(value)) return false;
+    status = value.toInt();
+    return true;
+}
+
+void ModemStatusCache::setTtl(int ttlMs) {
+    this->ttlMs = ttlMs;
+}
+
+bool ModemStatusCache::enableRegistrationUrc() {
+    // Once +CEREG is a URC prefix, the reply to AT+CEREG? reaches the handler
+    // as well, so both forms update the cache there.
+    modem->setUrcHandler("+CEREG:", [this](const String& params) { onRegistrationReport(params); });
+    std::vector<String> responses;
+    if (!modem->sendATCommandWithResponse("AT+CEREG=2", &responses) || responses.back() != "OK") {
+        return false;
+    }
+    registrationUrc = true;
+    return true;
+}
+
+void ModemStatusCache::invalidate() {
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    for (CachedValue* cached : {&imei, &iccid, &firmwareVersion, &signalQuality, &registrationStatus}) {
+        cached->valid = false;
+    }
+    // The stored identity may be just as outdated as the cache.
+    useIdentityStore = false;
+    xSemaphoreGive(cacheMutex);
+}
+
+bool ModemStatusCache::getIdentity(CachedValue& cached, String (ModemIdentityStore::*storedValue)() const,
+                                   const String& command, const String& prefix, String& value) {
+    if (readCached(cached, false, value)) return true;
+    // Stored values stand in for the modem while it boots. Once it answers,
+    // only values its check confirmed are taken over; if the check failed the
+    // modem is asked directly.
+    if (useIdentityStore && identityStore->isLoaded()) {
+        if (identityStore->isVerified()) {
+            value = (identityStore->*storedValue)();
+            store(cached, value);
+            return true;
+        }
+        if (!modem->isReady()) {
+            value = (identityStore->*storedValue)();
+            return true;
+        }
+    }
+    return getImmutable(cached, command, prefix, value);
+}
+
+bool ModemStatusCache::getImmutable(CachedValue& cached, const String& command, const String& prefix,
+                                    String& value) {
+    if (readCached(cached, false, value)) return true;
+    if (!query(command, prefix, value)) return false;
+    store(cached, value);
+    return true;
+}
+
+bool ModemStatusCache::getMutable(CachedValue& cached, const String& command, const String& prefix,
+                                  String& value) {
+    if (readCached(cached, true, value)) return true;
+    if (!query(command, prefix, value)) return false;
+    store(cached, value);
+    return true;
+}
+
+bool ModemStatusCache::queryRegistration(String& value) {
+    if (!registrationUrc) {
+        String response;
+        if (!query("AT+CEREG?", "+CEREG:", response)) return false;
+        int status = parseRegistrationStatus(response);
+        if (status < 0) return false;
+        value = String(status);
+        store(registrationStatus, value);
+        return true;
+    }
+
+    // The handler stores the status while the command is running; only a
+    // report that arrived during it counts.
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    uint32_t revision = registrationStatus.revision;
+    xSemaphoreGive(cacheMutex);
+    std::vector<String> responses;
+    if (!modem->sendATCommandWithResponse("AT+CEREG?", &responses) || responses.back() != "OK") return false;
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    bool updated = registrationStatus.revision != revision;
+    if (updated) value = registrationStatus.value;
+    xSemaphoreGive(cacheMutex);
+    return updated;
+}
+
+bool ModemStatusCache::readCached(const CachedValue& cached, bool checkTtl, String& value) {
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    bool fresh = cached.valid && (!checkTtl || millis() - cached.updatedAt < (unsigned long)ttlMs);
+    if (fresh) value = cached.value;
+    xSemaphoreGive(cacheMutex);
+    return fresh;
+}
+
+void ModemStatusCache::store(CachedValue& cached, const String& value) {
+    xSemaphoreTake(cacheMutex, portMAX_DELAY);
+    cached.value = value;
+    cached.valid = true;
+    cached.updatedAt = millis();
+    cached.revision++;
+    xSemaphoreGive(cacheMutex);
+}
+
+bool ModemStatusCache::query(const String& command, const String& prefix, String& value) {
+    std::vector<String> responses;
+    if (!modem->sendATCommandWithResponse(command, &responses) || responses.back() != "OK") {
+        return false;
+    }
+    for (const String& response : responses) {
+        if (response.length() == 0 || response == command || response == "OK") continue;
+        if (prefix.length() > 0) {
+            if (!response.startsWith(prefix)) continue;
+            value = response.substring(prefix.length());
+            value.trim();
+        } else {
+            // Unprefixed replies (IMEI, firmware) never start with '+'; such
+            // lines are unsolicited reports that arrived in between.
+            if (response.startsWith("+")) continue;
+            value = response;
+        }
+        return true;
+    }
+    return false;
+}
+
+void ModemStatusCache::onRegistrationReport(const String& params) {
+    // Runs in the reader task.
+    int status = parseRegistrationStatus(params);
+    if (status >= 0) store(registrationStatus, String(status));
+}
+
+int ModemStatusCache::parseRegistrationStatus(const String& params) {
+    // The reply to AT+CEREG? is "<n>,<stat>[,...]" while the URC is
+    // "<stat>[,<tac>,...]": if the second field is an unquoted number it is
+    // the reply form.
+    int comma = params.indexOf(',');
+    if (comma == -1) return params.length() > 0 ? params.toInt() : -1;
+    int next = params.indexOf(',', comma + 1);
+    String second = params.substring(comma + 1, next == -1 ? params.length() : next);
+    second.trim();
+    bool numeric = second.length() > 0;
+    for (size_t i = 0; i < second.length(); i++) {
+        if (!isDigit(second[i])) numeric = false;
+    }
+    return numeric ? second.toInt() : params.substring(0, comma).toInt();
+}
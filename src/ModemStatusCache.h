@@ -0,0 +1,55 @@
+
+// ModemStatusCache.h
+#ifndef MODEM_STATUS_CACHE_H
+#define MODEM_STATUS_CACHE_H
+
+#include <Arduino.h>
+#include "CM01-SARA-R.h"
+#include "ModemIdentityStore.h"
+
+class ModemStatusCache {
+public:
+    ModemStatusCache(ModemHandler& modem, int ttlMs = 10000, ModemIdentityStore* identityStore = nullptr);
+
+    bool getImei(String& imei);
+    bool getIccid(String& iccid);
+    bool getFirmwareVersion(String& version);
+    bool getSignalQuality(int& rssi, int& ber);
+    bool getRegistrationStatus(int& status);
+    void setTtl(int ttlMs);
+    bool enableRegistrationUrc();
+    void invalidate();
+
+private:
+    struct CachedValue {
+        String value;
+        bool valid;
+        unsigned long updatedAt;
+        uint32_t revision;
+    };
+
+    ModemHandler* modem;
+    ModemIdentityStore* identityStore;
+    int ttlMs;
+    SemaphoreHandle_t cacheMutex;
+    CachedValue imei;
+    CachedValue iccid;
+    CachedValue firmwareVersion;
+    CachedValue signalQuality;
+    CachedValue registrationStatus;
+    bool registrationUrc;
+    bool useIdentityStore;
+
+    bool getIdentity(CachedValue& cached, String (ModemIdentityStore::*storedValue)() const, const String& command,
+                     const String& prefix, String& value);
+    bool getImmutable(CachedValue& cached, const String& command, const String& prefix, String& value);
+    bool getMutable(CachedValue& cached, const String& command, const String& prefix, String& value);
+    bool queryRegistration(String& value);
+    bool readCached(const CachedValue& cached, bool checkTtl, String& value);
+    void store(CachedValue& cached, const String& value);
+    bool query(const String& command, const String& prefix, String& value);
+    void onRegistrationReport(const String& params);
+    static int parseRegistrationStatus(const String& params);
+};
+
+#endif // MODEM_STATUS_CACHE_H